@@ -0,0 +1,789 @@
+#define DISCORD_BOT_BENCHMARK
+#include "main.cpp"
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace bench {
+    // Only benchmarks whose name contains this run, set with --filter
+    std::string filter;
+
+    bool selected(const std::string &name) {
+        return name.find(filter) != std::string::npos;
+    }
+
+    template<typename T>
+    inline void keep(T &&value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    // Runs fn in batches until at least min_time has passed, then prints ns per item, fn handles items per call
+    template<typename F>
+    void run(const std::string &name, F &&fn, std::chrono::nanoseconds min_time = std::chrono::milliseconds(200), size_t items = 1) {
+        using clock = std::chrono::steady_clock;
+
+        if (!selected(name)) return;
+
+        size_t iterations = 0;
+        size_t batch = 1;
+        clock::duration total(0);
+
+        while (total < min_time) {
+            auto start = clock::now();
+            for (size_t i = 0; i < batch; i++)
+                fn();
+            total += clock::now() - start;
+            iterations += batch;
+            batch *= 2;
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(total).count() / (iterations * items);
+        printf("%-48s %12lu %12.1f ns/op\n", name.c_str(), iterations * items, ns);
+    }
+}
+
+namespace {
+    void fill_roles(GuildData &guild, util::slab_map<dpp::snowflake, GuildRoleData> &scan, size_t count) {
+        for (size_t i = 1; i <= count; i++) {
+            dpp::snowflake role_id = i;
+            auto &role = guild.roles.emplace(role_id, &guild, dpp::role()).first->second;
+            role.id = role_id;
+            role.name = fmt::format("role-{}", i);
+            guild.index_role(&role);
+            scan.emplace(role_id, role);
+        }
+    }
+
+    void bench_role_lookup() {
+        for (size_t count : { 250, 1000, 5000 }) {
+            GuildData guild;
+            util::slab_map<dpp::snowflake, GuildRoleData> scan;
+            fill_roles(guild, scan, count);
+
+            std::string last = fmt::format("role-{}", count);
+            std::string missing = "Verified";
+
+            bench::run(fmt::format("role by name scan/{}", count), [&]() {
+                bench::keep(util::get_by_value_or_null(scan, last));
+            });
+
+            bench::run(fmt::format("role by name index/{}", count), [&]() {
+                bench::keep(guild.get_role(last));
+            });
+
+            bench::run(fmt::format("role by name scan miss/{}", count), [&]() {
+                bench::keep(util::get_by_value_or_null(scan, missing));
+            });
+
+            bench::run(fmt::format("role by name index miss/{}", count), [&]() {
+                bench::keep(guild.find_role(missing));
+            });
+        }
+    }
+
+    template<typename map>
+    void bench_snowflake_lookup(const std::string &name, size_t count) {
+        map m;
+        std::vector<dpp::snowflake> keys;
+        std::mt19937_64 rng(count);
+
+        for (size_t i = 0; i < count; i++) {
+            dpp::snowflake id = rng() >> 1;
+            keys.push_back(id);
+            m.emplace(id, UserData());
+        }
+
+        size_t i = 0;
+        bench::run(fmt::format("{} find/{}", name, count), [&]() {
+            bench::keep(util::get_or_null(m, keys[i++ % count]));
+        });
+    }
+
+    void bench_snowflake_maps() {
+        for (size_t count : { 1000, 100000 }) {
+            bench_snowflake_lookup<std::map<dpp::snowflake, UserData>>("std::map", count);
+            bench_snowflake_lookup<util::slab_map<dpp::snowflake, UserData>>("slab_map", count);
+        }
+    }
+
+    // slab_map behind one global lock, the model before sharding
+    struct locked_map {
+        std::shared_mutex m;
+        util::slab_map<dpp::snowflake, UserData> map;
+
+        UserData *get(const dpp::snowflake &k) {
+            std::shared_lock lock(m);
+            return util::get_or_null(map, k);
+        }
+
+        void emplace(const dpp::snowflake &k) {
+            std::unique_lock lock(m);
+            map.emplace(k, UserData());
+        }
+    };
+
+    template<typename map>
+    void stress_cache(const std::string &name, size_t threads, map &m, const std::vector<dpp::snowflake> &keys) {
+        constexpr size_t ops = 1000000;
+        auto label = fmt::format("{} stress/{} threads", name, threads);
+        if (!bench::selected(label)) return;
+
+        std::atomic<bool> go = false;
+        std::vector<std::thread> workers;
+
+        for (size_t t = 0; t < threads; t++)
+            workers.emplace_back([&, t]() {
+                std::mt19937_64 rng(t);
+                while (!go) std::this_thread::yield();
+                for (size_t i = 0; i < ops; i++) {
+                    // 1 in 10 operations inserts a fresh user, the rest are lookups
+                    if (i % 10 == 0)
+                        m.emplace(dpp::snowflake((t + 1) << 48 | i));
+                    else
+                        bench::keep(m.get(keys[rng() % keys.size()]));
+                }
+            });
+
+        auto start = std::chrono::steady_clock::now();
+        go = true;
+        for (auto &w : workers)
+            w.join();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%-48s %12.0f ops/s\n", label.c_str(), threads * ops / s);
+    }
+
+    void bench_cache_stress() {
+        std::vector<dpp::snowflake> keys;
+        std::mt19937_64 rng(42);
+        for (size_t i = 0; i < 100000; i++)
+            keys.push_back(rng() >> 16);
+
+        for (size_t threads : { 1, 2, 4, 8 }) {
+            locked_map locked;
+            util::sharded_map<dpp::snowflake, UserData> sharded;
+
+            for (auto &k : keys) {
+                locked.emplace(k);
+                sharded.emplace(k);
+            }
+
+            stress_cache("global lock", threads, locked, keys);
+            stress_cache("sharded_map", threads, sharded, keys);
+        }
+    }
+
+    long read_status_kb(const char *field) {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        size_t n = strlen(field);
+        while (std::getline(status, line))
+            if (!line.compare(0, n, field))
+                return atol(line.c_str() + n + 1);
+        return 0;
+    }
+
+    // Runs fn in a child so peak RSS is not polluted by earlier runs
+    template<typename F>
+    void run_isolated(const std::string &name, F &&fn) {
+        if (!bench::selected(name)) return;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            long before = read_status_kb("VmRSS:");
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            long peak = read_status_kb("VmHWM:");
+            printf("%-48s %12.1f ms %10ld KiB peak RSS growth\n", name.c_str(), ms, peak - before);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+
+    void write_cold_start_files(size_t count, const std::string &json_path, const std::string &bin_path) {
+        BotDataContainer data;
+        std::vector<std::pair<uint64_t, std::string>> entries;
+
+        for (size_t i = 1; i <= count; i++) {
+            GuildData guild;
+            guild.id = dpp::snowflake(i << 22);
+            guild.name = fmt::format("guild-{}", i);
+            guild.welcome_channel = dpp::snowflake(i << 22 | 1);
+            guild.verify_role = dpp::snowflake(i << 22 | 2);
+            guild.verify_ephemeral = guild.interact_ephemeral = true;
+
+            auto cbor = nlohmann::json::to_cbor(nlohmann::json(guild));
+            entries.emplace_back((uint64_t)guild.id, std::string(cbor.begin(), cbor.end()));
+            data.guilds.emplace(guild.id, guild);
+        }
+
+        BotJournal::write_atomic(json_path, nlohmann::json(data).dump());
+        BotJournal::write_atomic(bin_path, BotSnapshot::encode(entries));
+    }
+
+    void bench_cold_start() {
+        for (size_t count : { 1000, 10000, 100000 }) {
+            std::string json_path = fmt::format("bench-{}.json", count);
+            std::string bin_path = fmt::format("bench-{}.bin", count);
+
+            write_cold_start_files(count, json_path, bin_path);
+
+            run_isolated(fmt::format("cold start json/{}", count), [&]() {
+                std::ifstream file(json_path);
+                nlohmann::json j;
+                file >> j;
+                auto data = j.template get<BotDataContainer>();
+                bench::keep(data);
+            });
+
+            run_isolated(fmt::format("cold start json sax/{}", count), [&]() {
+                std::string content, error;
+                util::read_file(json_path, content);
+                BotDataContainer data;
+                BotDataContainer::parse_json(content, data, error);
+                bench::keep(data);
+            });
+
+            run_isolated(fmt::format("cold start snapshot/{}", count), [&]() {
+                BotSnapshot snapshot;
+                snapshot.open(bin_path);
+                bench::keep(snapshot);
+            });
+
+            // Lazy materialization of the 1% of guilds that see traffic right after start
+            run_isolated(fmt::format("cold start snapshot + 1% decoded/{}", count), [&]() {
+                BotSnapshot snapshot;
+                snapshot.open(bin_path);
+                util::sharded_map<our_snowflake, GuildData> guilds;
+                for (size_t i = 1; i <= count; i += 100) {
+                    auto *e = snapshot.find(i << 22);
+                    auto [first, last] = snapshot.blob(e);
+                    guilds.emplace(e->id, nlohmann::json::from_cbor(first, last).template get<GuildData>());
+                }
+                bench::keep(guilds);
+            });
+
+            unlink(json_path.c_str());
+            unlink(bin_path.c_str());
+        }
+    }
+
+    void bench_cache_lookup() {
+        for (size_t count : { 1000, 100000 }) {
+            BotDataContainer data;
+            std::vector<dpp::snowflake> keys;
+            std::mt19937_64 rng(count);
+
+            for (size_t i = 0; i < count; i++) {
+                dpp::snowflake id = rng() >> 1;
+                keys.push_back(id);
+                data.users.emplace(id, UserData());
+                data.guilds.emplace(id, GuildData());
+            }
+
+            size_t i = 0;
+            bench::run(fmt::format("users get_or_null/{}", count), [&]() {
+                bench::keep(util::get_or_null(data.users, keys[i++ % count]));
+            });
+
+            // Keys above 2^63 are never generated
+            bench::run(fmt::format("users get_or_null miss/{}", count), [&]() {
+                bench::keep(util::get_or_null(data.users, dpp::snowflake(1ull << 63 | i++)));
+            });
+
+            bench::run(fmt::format("guilds get_or_null/{}", count), [&]() {
+                bench::keep(util::get_or_null(data.guilds, keys[i++ % count]));
+            });
+        }
+    }
+
+    void bench_add_guild_user() {
+        for (size_t count : { 100, 10000 }) {
+            run_isolated(fmt::format("add_guild_user/{}", count), [count]() {
+                Program prog;
+                UserData user;
+                dpp::guild_member member;
+
+                // Includes building and tearing down the guild the members go into
+                bench::run(fmt::format("add_guild_user/{}", count), [&]() {
+                    GuildData guild;
+                    for (size_t i = 1; i <= count; i++)
+                        prog.add_guild_user(&guild, &user, dpp::snowflake(i), member);
+                    bench::keep(guild);
+                }, std::chrono::milliseconds(200), count);
+            });
+        }
+    }
+
+    void bench_snowflake_json() {
+        dpp::snowflake id = 1234567890123456789ull;
+        nlohmann::json number = (uint64_t)id;
+        nlohmann::json string = std::to_string((uint64_t)id);
+
+        bench::run("our_snowflake to_json", [&]() {
+            nlohmann::json j;
+            nlohmann::adl_serializer<our_snowflake>::to_json(j, our_snowflake(id));
+            bench::keep(j);
+        });
+
+        bench::run("our_snowflake from_json number", [&]() {
+            bench::keep(number.template get<our_snowflake>());
+        });
+
+        bench::run("our_snowflake from_json string", [&]() {
+            bench::keep(string.template get<our_snowflake>());
+        });
+    }
+
+    void bench_responder_match() {
+        std::string text = "Hey everyone, does anyone know when the next robotics meeting is? "
+                           "I missed the announcement and the calendar link in the rules channel is broken.";
+
+        for (size_t count : { 100, 1000, 5000 }) {
+            std::vector<AutoResponderData> rules;
+            for (size_t i = 0; i < count; i++) {
+                AutoResponderData rule;
+                rule.kind = i % 10 == 9 ? "glob" : "keyword";
+                rule.pattern = i % 10 == 9 ? fmt::format("*link-{}*", i) : fmt::format("word-{}", i);
+                rule.reply = "reply";
+                rules.push_back(rule);
+            }
+            rules.back().pattern = "calendar";
+
+            AutoResponder responder(rules);
+            bench::run(fmt::format("responder match/{} rules", count), [&]() {
+                bench::keep(responder.match(text));
+            });
+        }
+    }
+
+    // Guilds with a member list each, users are shared between guilds like on a real bot
+    void fill_bot_data(Program &prog, size_t count, size_t members) {
+        for (size_t u = 1; u <= members * 4; u++) {
+            dpp::user user;
+            user.id = u;
+            user.username = fmt::format("user-{}", u);
+            prog.add_user(user.id, user);
+        }
+
+        for (size_t g = 1; g <= count; g++) {
+            GuildData guild;
+            guild.id = dpp::snowflake(g << 22);
+            guild.name = fmt::format("guild-{}", g);
+            guild.welcome_channel = dpp::snowflake(g << 22 | 1);
+            guild.verify_role = dpp::snowflake(g << 22 | 2);
+
+            auto *data = &prog.guilds.emplace(guild.id, guild).first->second;
+            for (size_t m = 0; m < members; m++) {
+                dpp::snowflake user_id = (g * 7 + m) % (members * 4) + 1;
+                dpp::guild_member member;
+                member.guild_id = guild.id;
+                member.user_id = user_id;
+                prog.add_guild_user(data, util::get_or_null(prog.users, user_id), user_id, member);
+            }
+        }
+    }
+
+    void bench_save_load() {
+        using clock = std::chrono::steady_clock;
+        auto ms = [](clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        };
+
+        for (size_t count : { 100, 1000, 10000 }) {
+            std::string path = fmt::format("bench-data-{}.bin", count);
+
+            run_isolated(fmt::format("save_data + load_data/{}", count), [&]() {
+                {
+                    Program prog;
+                    prog.bot_snapshot_file = path;
+                    prog.bot_data_file.clear();
+                    prog.load_data();
+                    fill_bot_data(prog, count, 20);
+
+                    auto start = clock::now();
+                    prog.save_data();
+                    printf("%-48s %12.1f ms\n", fmt::format("save_data/{}", count).c_str(), ms(start));
+                }
+
+                Program prog;
+                prog.bot_snapshot_file = path;
+                prog.bot_data_file.clear();
+
+                auto start = clock::now();
+                prog.load_data();
+                printf("%-48s %12.1f ms\n", fmt::format("load_data/{}", count).c_str(), ms(start));
+
+                start = clock::now();
+                for (size_t g = 1; g <= count; g++)
+                    bench::keep(prog.find_guild(dpp::snowflake(g << 22)));
+                printf("%-48s %12.1f ms\n", fmt::format("load_data all guilds decoded/{}", count).c_str(), ms(start));
+
+                prog.save_data();
+            });
+
+            unlink(path.c_str());
+            unlink((path + ".journal").c_str());
+        }
+    }
+
+    void bench_cache_evict() {
+        using clock = std::chrono::steady_clock;
+
+        for (size_t count : { 1000, 10000 }) {
+            run_isolated(fmt::format("cache sweep/{}", count), [count]() {
+                Program prog;
+                fill_bot_data(prog, count, 20);
+                size_t entries = prog.users.size() + count * 20;
+
+                // Under the cap the sweep only walks and flips referenced bits
+                prog.cache_max_entries = entries;
+                bench::run(fmt::format("cache sweep/{}", count), [&]() {
+                    bench::keep(prog.evict_caches());
+                }, std::chrono::milliseconds(200), entries);
+
+                // Every bit is clear after the timed sweeps, this one evicts down to half
+                prog.cache_max_entries = entries / 2;
+                auto start = clock::now();
+                size_t evicted = prog.evict_caches();
+                printf("%-48s %12lu %12.1f ms\n", fmt::format("cache evict half/{}", count).c_str(), evicted,
+                    std::chrono::duration<double, std::milli>(clock::now() - start).count());
+            });
+        }
+    }
+
+    // Like run_isolated, but fn returns a json result that is passed back to the parent over a pipe
+    template<typename F>
+    nlohmann::json run_isolated_json(F &&fn) {
+        int fds[2];
+        if (pipe(fds)) return nullptr;
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            long before = read_status_kb("VmRSS:");
+            nlohmann::json result = fn();
+            result["rss_kb"] = read_status_kb("VmHWM:") - before;
+
+            auto out = result.dump();
+            for (size_t n = 0; n < out.size();) {
+                ssize_t w = write(fds[1], out.data() + n, out.size() - n);
+                if (w <= 0) break;
+                n += w;
+            }
+            _exit(0);
+        }
+
+        close(fds[1]);
+        std::string out;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+            out.append(buf, n);
+        close(fds[0]);
+        waitpid(pid, nullptr, 0);
+
+        auto result = nlohmann::json::parse(out, nullptr, false);
+        return result.is_discarded() ? nlohmann::json() : result;
+    }
+}
+
+/*
+ * Gateway event replay. Synthetic event streams go straight into the Program
+ * handlers with a FakeBackend behind them, as fast as the handlers accept them.
+ * Latency is measured per event from the call until its task completes, tasks
+ * that suspend are polled in windows of 1024 so the replay keeps a bounded
+ * number of events in flight.
+ */
+namespace replay {
+    using clock = std::chrono::steady_clock;
+
+    constexpr size_t window = 1024;
+
+    // Same id layout as FakeBackend::generate_fixtures
+    dpp::snowflake id(uint64_t kind, uint64_t n) {
+        return kind << 40 | n;
+    }
+
+    // The event constructors differ between DPP versions, none of them need a live shard here
+    template<typename T>
+    T make_event() {
+        if constexpr (std::is_default_constructible_v<T>)
+            return T();
+        else if constexpr (std::is_constructible_v<T, dpp::discord_client*, const std::string&>)
+            return T(nullptr, "");
+        else
+            return T(nullptr, 0, "");
+    }
+
+    dpp::interaction make_interaction(uint64_t g, uint64_t u) {
+        dpp::interaction i;
+        i.guild_id = id(1, g);
+        i.channel_id = id(4, g);
+        i.member.guild_id = id(1, g);
+        i.member.user_id = id(3, u);
+        i.usr.id = id(3, u);
+        return i;
+    }
+
+    struct recorder {
+        struct inflight {
+            clock::time_point start;
+            dpp::task<void> task;
+        };
+
+        std::vector<uint32_t> latency_ns;
+        std::vector<inflight> pending;
+        clock::time_point started = clock::now();
+
+        recorder(size_t events) {
+            latency_ns.reserve(events);
+            pending.reserve(window);
+        }
+
+        void record(clock::time_point start, clock::time_point end) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            latency_ns.push_back((uint32_t)std::min<int64_t>(ns, std::numeric_limits<uint32_t>::max()));
+        }
+
+        void track(clock::time_point start, dpp::task<void> &&task) {
+            if (task.done()) {
+                record(start, clock::now());
+                return;
+            }
+
+            pending.push_back({ start, std::move(task) });
+            if (pending.size() >= window)
+                drain();
+        }
+
+        void drain() {
+            while (!pending.empty()) {
+                auto now = clock::now();
+                std::erase_if(pending, [&](inflight &p) {
+                    if (!p.task.done()) return false;
+                    record(p.start, now);
+                    return true;
+                });
+                if (!pending.empty())
+                    std::this_thread::yield();
+            }
+        }
+
+        nlohmann::json result() {
+            drain();
+            double seconds = std::chrono::duration<double>(clock::now() - started).count();
+
+            auto quantile = [&](double q) {
+                if (latency_ns.empty()) return 0.0;
+                size_t n = std::min(latency_ns.size() - 1, (size_t)(q * latency_ns.size()));
+                std::nth_element(latency_ns.begin(), latency_ns.begin() + n, latency_ns.end());
+                return latency_ns[n] / 1000.0;
+            };
+
+            return {
+                { "events", latency_ns.size() },
+                { "events_per_second", latency_ns.size() / seconds },
+                { "p50_us", quantile(0.5) },
+                { "p99_us", quantile(0.99) }
+            };
+        }
+    };
+
+    // Runs in a forked child that exits right after, the Program is leaked rather than torn down under live jobs
+    Program &setup(size_t guild_count, size_t members) {
+        auto &prog = *new Program();
+        prog.metrics_file.clear();
+        auto *fake = prog.use_fake_backend(FakeBackend::generate_fixtures(guild_count, members, 5));
+        // Welcome windows and revalidation pauses shrink to milliseconds
+        fake->time_scale = 0.001;
+        return prog;
+    }
+
+    // Every member of every guild joins, guilds interleaved so each sees a burst
+    nlohmann::json joins(size_t guild_count, size_t count) {
+        auto &prog = setup(guild_count, count / guild_count);
+
+        recorder rec(count);
+        for (size_t i = 0; i < count; i++) {
+            uint64_t g = i % guild_count + 1;
+            uint64_t u = i / guild_count + 1;
+
+            auto e = make_event<dpp::guild_member_add_t>();
+            e.adding_guild.id = id(1, g);
+            e.added.guild_id = id(1, g);
+            e.added.user_id = id(3, u);
+
+            auto start = clock::now();
+            rec.track(start, prog.handle_guild_user_add(std::move(e)));
+        }
+
+        auto result = rec.result();
+        prog.wait_idle(std::chrono::seconds(60));
+        return result;
+    }
+
+    // Mostly plain messages with 1.5% slash commands and 0.5% verify clicks, caches warmed by a ready sequence
+    nlohmann::json messages(size_t guild_count, size_t members, size_t count) {
+        auto &prog = setup(guild_count, members);
+
+        {
+            auto ready = prog.on_ready();
+            prog.wait_idle(std::chrono::seconds(120));
+        }
+
+        static const std::pair<const char*, const char*> commands[] = {
+            { "help", "" }, { "info", "server" }, { "info", "bot" }
+        };
+
+        std::mt19937_64 rng(count);
+        recorder rec(count);
+
+        for (size_t i = 0; i < count; i++) {
+            uint64_t g = rng() % guild_count + 1;
+            uint64_t u = rng() % members + 1;
+            uint64_t roll = rng() % 1000;
+
+            if (roll < 15) {
+                auto e = make_event<dpp::slashcommand_t>();
+                e.command = make_interaction(g, u);
+                e.command.type = dpp::it_application_command;
+
+                auto &[name, sub] = commands[roll % std::size(commands)];
+                dpp::command_interaction data;
+                data.name = name;
+                if (*sub) {
+                    dpp::command_data_option option;
+                    option.name = sub;
+                    option.type = dpp::co_sub_command;
+                    data.options.push_back(option);
+                }
+                e.command.data = data;
+
+                auto start = clock::now();
+                rec.track(start, prog.handle_slashcommand(std::move(e)));
+            } else if (roll < 20) {
+                auto e = make_event<dpp::button_click_t>();
+                e.command = make_interaction(g, u);
+                e.command.type = dpp::it_component_button;
+                e.custom_id = "verify_button";
+
+                auto start = clock::now();
+                rec.track(start, prog.handle_button_click(std::move(e)));
+            } else {
+                auto e = make_event<dpp::message_create_t>();
+                e.msg.id = id(5, i + 1);
+                e.msg.guild_id = id(1, g);
+                e.msg.channel_id = id(4, g);
+                e.msg.author.id = id(3, u);
+                e.msg.content = "hello";
+
+                auto start = clock::now();
+                prog.handle_message(e);
+                rec.record(start, clock::now());
+            }
+        }
+
+        auto result = rec.result();
+        prog.wait_idle(std::chrono::seconds(60));
+        return result;
+    }
+
+    // A scenario regresses when throughput drops or p99 grows by more than this fraction
+    constexpr double tolerance = 0.10;
+
+    bool report(const std::string &name, const nlohmann::json &r, const nlohmann::json &baseline) {
+        if (r.is_null()) {
+            printf("%-48s failed\n", name.c_str());
+            return false;
+        }
+
+        printf("%-48s %12.0f ev/s  p50 %8.1f us  p99 %8.1f us %10ld KiB peak RSS growth\n", name.c_str(),
+            r["events_per_second"].get<double>(), r["p50_us"].get<double>(), r["p99_us"].get<double>(), r["rss_kb"].get<long>());
+
+        if (!baseline.contains(name))
+            return true;
+
+        auto &b = baseline[name];
+        double throughput = r["events_per_second"].get<double>() / b.value("events_per_second", 1.0) - 1;
+        double p99 = r["p99_us"].get<double>() / b.value("p99_us", 1.0) - 1;
+        bool regressed = throughput < -tolerance || p99 > tolerance;
+
+        printf("%-48s %+11.1f%%        %+8.1f%% p99%s\n", "  vs baseline", throughput * 100, p99 * 100, regressed ? "  REGRESSION" : "");
+        return !regressed;
+    }
+
+    int run(const std::string &baseline_path, const std::string &save_path) {
+        nlohmann::json baseline = nlohmann::json::object();
+        if (baseline_path.size()) {
+            std::string content;
+            if (util::read_file(baseline_path, content) == 0)
+                baseline = nlohmann::json::parse(content, nullptr, false);
+            if (!baseline.is_object()) {
+                fprintf(stderr, "Could not read baseline %s\n", baseline_path.c_str());
+                return -1;
+            }
+        }
+
+        nlohmann::json results = nlohmann::json::object();
+        bool ok = true;
+
+        auto scenario = [&](const std::string &name, auto &&fn) {
+            if (!bench::selected(name)) return;
+            auto r = run_isolated_json(fn);
+            ok &= report(name, r, baseline);
+            if (!r.is_null())
+                results[name] = r;
+        };
+
+        scenario("replay joins/100000 over 1000 guilds", []() { return joins(1000, 100000); });
+        scenario("replay messages/1000000 over 1000 guilds", []() { return messages(1000, 100, 1000000); });
+
+        if (save_path.size())
+            BotJournal::write_atomic(save_path, results.dump(4));
+
+        return ok ? 0 : 1;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string suite = "all";
+    std::string baseline, save_baseline;
+
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--baseline" && i + 1 < argc)
+            baseline = argv[++i];
+        else if (arg == "--save-baseline" && i + 1 < argc)
+            save_baseline = argv[++i];
+        else if (arg == "--filter" && i + 1 < argc)
+            bench::filter = argv[++i];
+        else
+            suite = arg;
+    }
+
+    if (suite == "all" || suite == "micro") {
+        bench_role_lookup();
+        bench_snowflake_maps();
+        bench_cache_lookup();
+        bench_add_guild_user();
+        bench_snowflake_json();
+        bench_responder_match();
+        bench_cache_stress();
+        bench_cold_start();
+        bench_save_load();
+        bench_cache_evict();
+    }
+
+    if (suite == "all" || suite == "replay")
+        return replay::run(baseline, save_baseline);
+
+    return 0;
+}
@@ -1,15 +1,43 @@
 #include <cstdlib>
 #include <string>
+#include <string_view>
+#include <variant>
+#include <type_traits>
+#include <iterator>
 #include <string.h>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <functional>
 #include <algorithm>
 #include <stdio.h>
 #include <fstream>
 #include <mutex>
-#include <condition_variable>
+#include <shared_mutex>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <bit>
+#include <utility>
+#include <tuple>
+#include <cstdint>
+#include <coroutine>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <queue>
+#include <random>
+#include <filesystem>
 #include <fmt/format.h>
 
 #include <dpp/json.h>
@@ -76,10 +104,14 @@ NLOHMANN_JSON_NAMESPACE_END
 namespace util {
     template<typename map, typename key_type = map::key_type, typename value_type = map::mapped_type>
     value_type *get_or_null(map &it, const key_type &key) {
-        auto end = it.end();
-        auto iter = it.find(key);
-        if (iter == end) return (value_type*)(nullptr);
-        return &(iter->second);
+        if constexpr (requires { it.get(key); }) {
+            return it.get(key);
+        } else {
+            auto end = it.end();
+            auto iter = it.find(key);
+            if (iter == end) return (value_type*)(nullptr);
+            return &(iter->second);
+        }
     }
     
     template<typename map, typename find_type, typename value_type = map::mapped_type>
@@ -90,351 +122,4189 @@ namespace util {
         return (value_type*)(nullptr);
     }
 
-    struct hold;
+    using json_scalar = std::variant<std::nullptr_t, bool, int64_t, uint64_t, double, std::string>;
 
-    struct wait_for {
-        bool done;
-        std::mutex m;
-        std::condition_variable cv;
+    struct json_frame {
+        std::string key;
+        size_t index = 0;
+        bool array = false;
+    };
 
-        wait_for():done(false){}
+    /*
+     * SAX handler that keeps the path to the current value, so scalars can be
+     * bound straight to struct fields without building a DOM first.
+     * on_end is called after a container closes with the path of its parent.
+     */
+    struct json_path_reader : nlohmann::json_sax<nlohmann::json> {
+        using path_type = std::vector<json_frame>;
+
+        std::function<void(const path_type&, json_scalar&&)> on_value;
+        std::function<void(const path_type&)> on_end;
+
+        std::string error;
+
+        bool parse(const std::string &content) {
+            path.clear();
+            error.clear();
+            this->content = &content;
+            return nlohmann::json::sax_parse(content, this) && error.empty();
+        }
 
-        void notify() {
-            std::unique_lock<std::mutex> lock(m);
-            done = true;
-            //printf("notify     %p\n", this);
-            cv.notify_all();
+        bool null() override { return value(nullptr); }
+        bool boolean(bool v) override { return value(v); }
+        bool number_integer(number_integer_t v) override { return value((int64_t)v); }
+        bool number_unsigned(number_unsigned_t v) override { return value((uint64_t)v); }
+        bool number_float(number_float_t v, const string_t &) override { return value((double)v); }
+        bool string(string_t &v) override { return value(std::move(v)); }
+        bool binary(binary_t &) override { return value(nullptr); }
+
+        bool start_object(std::size_t) override {
+            path.push_back({ "", 0, false });
+            return true;
         }
 
-        void wait() {
-            //printf("wait       %p\n", this);
-            std::unique_lock<std::mutex> lock(m);
-            while (!done) cv.wait(lock);
-            //printf("complete   %p\n", this);
+        bool key(string_t &k) override {
+            path.back().key = k;
+            return true;
         }
 
-        util::hold hold();
-    };
+        bool end_object() override { return end(); }
 
-    struct auto_wait : public wait_for {
-        auto_wait() {
-            //printf("auto_wait  %p\n", this);
+        bool start_array(std::size_t) override {
+            path.push_back({ "", 0, true });
+            return true;
         }
 
-        ~auto_wait() {
-            wait();
-            //printf("~auto_wait %p\n", this);
-        }
-    };
+        bool end_array() override { return end(); }
 
-    struct hold {
-        hold(wait_for *w):w(w) { 
-            //printf("auto_hold  %p\n", w);
+        bool parse_error(std::size_t position, const std::string &last_token, const nlohmann::detail::exception &ex) override {
+            auto [line, column] = line_column(position);
+            error = fmt::format("line {} column {}: {}", line, column, ex.what());
+            return false;
         }
-        hold(wait_for &w):hold(&w) { }
-        hold(auto_wait &w):hold(&w) { }
-        ~hold() {
-            w->notify();
-            //printf("~auto_hold %p\n", w);
-        }
-        wait_for *w;
-    };
 
-    util::hold util::wait_for::hold() {
-        return { this };
-    }
-}
+        private:
 
-struct UserData;
-struct GuildRoleData;
-struct GuildUserData;
-struct GuildData;
+        path_type path;
+        const std::string *content = nullptr;
 
-struct UserData {
-    dpp::user cached;
+        bool value(json_scalar &&v) {
+            if (on_value) on_value(path, std::move(v));
+            advance();
+            return true;
+        }
 
-    dpp::snowflake id;
-    std::string username;
-    std::string display_name;
+        bool end() {
+            path.pop_back();
+            if (on_end) on_end(path);
+            advance();
+            return true;
+        }
 
-    UserData() { }
-    UserData(const dpp::user &user):cached(user) { }
-};
+        void advance() {
+            if (path.size() && path.back().array)
+                path.back().index++;
+        }
 
-struct GuildRoleData {
-    dpp::role cached;
+        std::pair<size_t, size_t> line_column(size_t position) const {
+            size_t line = 1, column = 1;
+            size_t end = std::min(position, content->size());
+            for (size_t i = 0; i < end; i++) {
+                if ((*content)[i] == '\n') {
+                    line++;
+                    column = 1;
+                } else {
+                    column++;
+                }
+            }
+            return { line, column };
+        }
+    };
 
-    GuildData *guild;
+    inline void scalar_to(const json_scalar &v, std::string &out) {
+        if (auto *s = std::get_if<std::string>(&v)) out = *s;
+    }
 
-    dpp::snowflake id;
-    std::string name;
+    inline void scalar_to(const json_scalar &v, bool &out) {
+        if (auto *b = std::get_if<bool>(&v)) out = *b;
+    }
 
-    GuildRoleData():id(0),guild(0) {}
-    GuildRoleData(GuildData *guild, const dpp::role &role):guild(guild),cached(role) { }
+    template<typename T> requires std::is_arithmetic_v<T>
+    void scalar_to(const json_scalar &v, T &out) {
+        if (auto *n = std::get_if<uint64_t>(&v)) out = (T)*n;
+        else if (auto *i = std::get_if<int64_t>(&v)) out = (T)*i;
+        else if (auto *d = std::get_if<double>(&v)) out = (T)*d;
+    }
 
-    friend bool operator==(const GuildRoleData &a, const std::string &b) {
-        return a.name == b;
+    // Same rules as the our_snowflake serializer, string or number, anything else is 0
+    inline void scalar_to(const json_scalar &v, our_snowflake &out) {
+        if (auto *s = std::get_if<std::string>(&v)) out = our_snowflake(*s);
+        else if (auto *n = std::get_if<uint64_t>(&v)) out = our_snowflake(*n);
+        else if (auto *i = std::get_if<int64_t>(&v)) out = our_snowflake((uint64_t)*i);
+        else out = our_snowflake(0);
     }
-};
 
-struct GuildUserData {
-    dpp::guild_member cached;
+    inline uint64_t unix_now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
 
-    UserData *user;
-    GuildData *guild;
+    inline int read_file(const std::string &path, std::string &out) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) return -1;
+        out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return 0;
+    }
 
-    std::string nickname;
+    inline uint64_t hash_snowflake(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
 
-    GuildUserData():user(0),guild(0) { }
-    GuildUserData(UserData *user, GuildData *guild, const dpp::guild_member &guild_member):user(user),guild(guild),cached(guild_member) { }
-};
+    /*
+     * Snowflake keyed map, entries live in slabs that are never moved or
+     * reallocated so pointers stay valid until the entry is erased.
+     * Lookups go through a flat open addressing index (linear probing)
+     * holding the key and the slot number.
+     */
+    template<typename key, typename mapped>
+    struct slab_map {
+        using key_type = key;
+        using mapped_type = mapped;
+        using value_type = std::pair<const key, mapped>;
+
+        static constexpr uint32_t empty_slot = UINT32_MAX;
+        static constexpr uint32_t dead_slot = UINT32_MAX - 1;
+        static constexpr uint32_t first_slab = 8;
+
+        struct bucket {
+            uint64_t id;
+            uint32_t slot;
+        };
 
-struct ChannelData {
-    dpp::channel cached;
+        template<bool is_const>
+        struct basic_iterator {
+            using map_type = std::conditional_t<is_const, const slab_map, slab_map>;
+            using reference = std::conditional_t<is_const, const value_type&, value_type&>;
+            using pointer = std::conditional_t<is_const, const value_type*, value_type*>;
 
-    std::string name;
-    dpp::snowflake id;
+            map_type *map;
+            uint32_t slot;
 
-    ChannelData() { }
-    ChannelData(const dpp::channel &channel):cached(channel) { }
-};
+            reference operator*() const { return *map->at(slot); }
+            pointer operator->() const { return map->at(slot); }
 
-struct GuildChannelData {
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(GuildChannelData, id, bot_allowed);
+            basic_iterator &operator++() {
+                slot = map->next_live(slot + 1);
+                return *this;
+            }
 
-    ChannelData *channel;
-    GuildData *guild;
+            friend bool operator==(const basic_iterator &a, const basic_iterator &b) {
+                return a.slot == b.slot;
+            }
 
-    std::string name;
-    our_snowflake id;
+            operator basic_iterator<true>() const requires (!is_const) { return { map, slot }; }
+        };
 
-    bool bot_allowed;
+        using iterator = basic_iterator<false>;
+        using const_iterator = basic_iterator<true>;
 
-    GuildChannelData():guild(0),channel(0),bot_allowed(1) { }
-    GuildChannelData(GuildData *guild_data, ChannelData *channel_data):guild(guild_data),channel(channel_data),bot_allowed(1) { }
-};
+        slab_map() { }
 
-struct GuildData {
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(GuildData, id, name, verify_ephemeral, interact_ephemeral, welcome_channel, verify_role, bot_operator_role);
+        slab_map(const slab_map &other) {
+            for (auto &v : other)
+                emplace(v);
+        }
 
-    dpp::guild cached;
+        slab_map(slab_map &&other) noexcept { swap(other); }
 
-    std::map<dpp::snowflake, GuildRoleData> roles;
-    std::map<dpp::snowflake, GuildUserData> users;
-    std::map<dpp::snowflake, GuildChannelData> channels;
+        slab_map &operator=(slab_map other) {
+            swap(other);
+            return *this;
+        }
 
-    our_snowflake welcome_channel;
-    our_snowflake verify_role;
-    our_snowflake bot_operator_role;
+        ~slab_map() {
+            clear();
+        }
 
-    bool verify_ephemeral;
-    bool interact_ephemeral;
+        void swap(slab_map &other) noexcept {
+            std::swap(slabs, other.slabs);
+            std::swap(live, other.live);
+            std::swap(free_slots, other.free_slots);
+            std::swap(index, other.index);
+            std::swap(used, other.used);
+            std::swap(count, other.count);
+            std::swap(tombstones, other.tombstones);
+        }
 
-    std::string name;
-    our_snowflake id;
+        size_t size() const { return count; }
+        bool empty() const { return !count; }
 
-    GuildRoleData* get_role(const std::string &text) {
-        return util::get_by_value_or_null(roles, text);
-    }
+        iterator begin() { return { this, next_live(0) }; }
+        iterator end() { return { this, (uint32_t)live.size() }; }
+        const_iterator begin() const { return { this, next_live(0) }; }
+        const_iterator end() const { return { this, (uint32_t)live.size() }; }
 
-    GuildRoleData* get_role(const dpp::snowflake &role_id) {
-        return util::get_or_null(roles, role_id);
-    }
+        iterator find(const key_type &k) {
+            auto *b = find_bucket(k);
+            return b ? iterator{ this, b->slot } : end();
+        }
 
-    GuildUserData* get_user(const dpp::snowflake &user_id) {
-        return util::get_or_null(users, user_id);
-    }
+        const_iterator find(const key_type &k) const {
+            auto *b = find_bucket(k);
+            return b ? const_iterator{ this, b->slot } : end();
+        }
 
-    GuildChannelData* get_channel(const dpp::snowflake &channel_id) {
-        return util::get_or_null(channels, channel_id);
-    }
+        bool contains(const key_type &k) const {
+            return find_bucket(k) != nullptr;
+        }
 
-    GuildData() { }
-    GuildData(const dpp::guild &guild):cached(guild),verify_ephemeral(1),interact_ephemeral(1) { }
-};
+        template<typename ...Args>
+        std::pair<iterator, bool> emplace(Args &&...args) {
+            uint32_t slot = acquire_slot();
+            auto *v = new (at(slot)) value_type(std::forward<Args>(args)...);
 
-struct ConfigData {
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ConfigData, token_file, token, config_data_file, bot_data_file, pool_size);
+            if (auto *b = find_bucket(v->first)) {
+                v->~value_type();
+                free_slots.push_back(slot);
+                return { { this, b->slot }, false };
+            }
 
-    std::string token_file;
-    std::string token;
+            if ((count + tombstones + 1) * 4 > index.size() * 3)
+                rehash(std::max<size_t>(16, std::bit_ceil((count + 1) * 2)));
 
-    std::string bot_data_file;
-    std::string config_data_file;
+            live[slot] = 1;
+            count++;
+            insert_bucket((uint64_t)v->first, slot);
+            return { { this, slot }, true };
+        }
 
-    uint32_t pool_size;
+        size_t erase(const key_type &k) {
+            auto *b = find_bucket(k);
+            if (!b) return 0;
 
-    int load_config() {
-        if (!config_data_file.size()) return log_config("No path for config data\n");
+            uint32_t slot = b->slot;
+            b->slot = dead_slot;
+            tombstones++;
 
-        std::ifstream file(config_data_file);
+            at(slot)->~value_type();
+            live[slot] = 0;
+            free_slots.push_back(slot);
+            count--;
+            return 1;
+        }
 
-        if (!file.is_open()) {
-            log_config("No config data found, creating\n");
-            return save_config();
-        } 
+        void clear() {
+            for (uint32_t slot = 0; slot < live.size(); slot++)
+                if (live[slot])
+                    at(slot)->~value_type();
+            slabs.clear();
+            live.clear();
+            free_slots.clear();
+            index.clear();
+            used = count = tombstones = 0;
+        }
 
-        nlohmann::json j;
+        // Bytes held by slabs and index, not counting what the values own
+        size_t memory_usage() const {
+            return live.size() * (sizeof(value_type) + 1) + index.size() * sizeof(bucket) + free_slots.capacity() * sizeof(uint32_t);
+        }
 
-        if (!j.accept(file)) return log_config("Invalid config json data\n");
+        value_type *at(uint32_t slot) {
+            auto [s, offset] = locate(slot);
+            return reinterpret_cast<value_type*>(slabs[s].get()) + offset;
+        }
 
-        file.seekg(0);
-        file >> j;
+        const value_type *at(uint32_t slot) const {
+            auto [s, offset] = locate(slot);
+            return reinterpret_cast<const value_type*>(slabs[s].get()) + offset;
+        }
 
-        *this = j.template get<ConfigData>();
+        private:
 
-        log_config("Loaded config data json\n");
+        struct slab_deleter {
+            void operator()(unsigned char *p) const { ::operator delete[](p, std::align_val_t(alignof(value_type))); }
+        };
 
-        return 0;
-    }
-    
-    int save_config() {
-        if (!config_data_file.size()) return log_config("No path for config data\n");
+        std::vector<std::unique_ptr<unsigned char[], slab_deleter>> slabs;
+        std::vector<uint8_t> live;
+        std::vector<uint32_t> free_slots;
+        std::vector<bucket> index;
+        uint32_t used = 0;
+        size_t count = 0;
+        size_t tombstones = 0;
+
+        // Slab n holds first_slab << n entries so small maps stay small
+        static std::pair<uint32_t, uint32_t> locate(uint32_t slot) {
+            uint32_t s = std::bit_width((slot / first_slab) + 1) - 1;
+            return { s, slot - first_slab * ((1u << s) - 1) };
+        }
 
-        std::ofstream file(config_data_file);
+        uint32_t next_live(uint32_t slot) const {
+            while (slot < live.size() && !live[slot]) slot++;
+            return slot;
+        }
 
-        if (!file.is_open()) return log_config("Could not open config data path for saving\n");
+        uint32_t acquire_slot() {
+            if (free_slots.size()) {
+                uint32_t slot = free_slots.back();
+                free_slots.pop_back();
+                return slot;
+            }
+            if (used == live.size()) {
+                size_t n = (size_t)first_slab << slabs.size();
+                auto *p = static_cast<unsigned char*>(::operator new[](n * sizeof(value_type), std::align_val_t(alignof(value_type))));
+                slabs.emplace_back(p);
+                live.resize(live.size() + n, 0);
+            }
+            return used++;
+        }
 
-        nlohmann::json j = *this;
+        const bucket *find_bucket(const key_type &k) const {
+            if (index.empty()) return nullptr;
+            uint64_t id = (uint64_t)k;
+            size_t mask = index.size() - 1;
+            for (size_t i = hash_snowflake(id) & mask;; i = (i + 1) & mask) {
+                auto &b = index[i];
+                if (b.slot == empty_slot) return nullptr;
+                if (b.slot != dead_slot && b.id == id) return &b;
+            }
+        }
 
-        file << j;
+        bucket *find_bucket(const key_type &k) {
+            return const_cast<bucket*>(std::as_const(*this).find_bucket(k));
+        }
 
-        log_config("Saved config data json\n");
+        void insert_bucket(uint64_t id, uint32_t slot) {
+            size_t mask = index.size() - 1;
+            size_t i = hash_snowflake(id) & mask;
+            while (index[i].slot != empty_slot && index[i].slot != dead_slot)
+                i = (i + 1) & mask;
+            if (index[i].slot == dead_slot) tombstones--;
+            index[i] = { id, slot };
+        }
 
-        return 0;
-    }
+        void rehash(size_t buckets) {
+            index.assign(buckets, { 0, empty_slot });
+            tombstones = 0;
+            size_t mask = buckets - 1;
+            for (uint32_t slot = 0; slot < live.size(); slot++) {
+                if (!live[slot]) continue;
+                uint64_t id = (uint64_t)at(slot)->first;
+                size_t i = hash_snowflake(id) & mask;
+                while (index[i].slot != empty_slot)
+                    i = (i + 1) & mask;
+                index[i] = { id, slot };
+            }
+        }
+    };
 
-    int load_token() {
-        if (token.size()) return 0;
-        if (!token_file.size()) return log_config("No TOKEN file and supplied token in config is undefined\n");
-        std::ifstream file(token_file);
-        if (!file.is_open()) return log_config(fmt::format("Could not open token_file ({})\n", token_file));
-        std::getline(file, token, '\n');
-        if (!token.size()) return log_config("token length in TOKEN file is 0\n");
-        return 0;
+    template<typename key, typename mapped>
+    void to_json(nlohmann::json &j, const slab_map<key, mapped> &map) {
+        j = nlohmann::json::array();
+        for (auto &[k, v] : map)
+            j.push_back({ k, v });
     }
 
-    ConfigData()
-        :token_file("TOKEN"),
-         token(),
-         config_data_file("config.json"),
-         bot_data_file("data.json"),
-         pool_size(0) { }
-
-    protected:
-
-    int log_config(const std::string &str) {
-        return fprintf(stderr, "%s", str.c_str());
+    template<typename key, typename mapped>
+    void from_json(const nlohmann::json &j, slab_map<key, mapped> &map) {
+        map.clear();
+        for (auto &e : j)
+            map.emplace(e.at(0).template get<key>(), e.at(1).template get<mapped>());
     }
-};
 
-struct BotDataContainer {
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(BotDataContainer, guilds);
+    // Mutex that can live in copyable structs, copies get a fresh unlocked mutex
+    struct rw_mutex : std::shared_mutex {
+        rw_mutex() { }
+        rw_mutex(const rw_mutex &) { }
+        rw_mutex &operator=(const rw_mutex &) { return *this; }
+    };
 
-    std::map<dpp::snowflake, UserData> users;
-    std::map<our_snowflake, GuildData> guilds;
-    std::map<dpp::snowflake, ChannelData> channels;
-};
+    template<typename T>
+    struct copyable_atomic : std::atomic<T> {
+        copyable_atomic(T v = T()):std::atomic<T>(v) { }
+        copyable_atomic(const copyable_atomic &other):std::atomic<T>(other.load()) { }
+        copyable_atomic &operator=(const copyable_atomic &other) {
+            this->store(other.load());
+            return *this;
+        }
+        using std::atomic<T>::operator=;
+    };
 
-struct BotData : public ConfigData, public BotDataContainer {
-    dpp::cluster bot;
+    /*
+     * slab_map split into shards by snowflake, each behind its own reader/writer
+     * lock. Entries are pointer stable so get() can hand out pointers after the
+     * shard lock is released, only erase() invalidates them.
+     */
+    template<typename key, typename mapped, size_t shard_count = 16>
+    struct sharded_map {
+        using key_type = key;
+        using mapped_type = mapped;
+        using value_type = std::pair<const key, mapped>;
+
+        struct shard {
+            mutable rw_mutex m;
+            slab_map<key, mapped> map;
+        };
 
-    int load_data() {
-        if (!bot_data_file.size()) return log_config("No path for bot data\n");
+        sharded_map() { }
 
-        std::ifstream file(bot_data_file);
+        sharded_map(const sharded_map &other) {
+            for (size_t i = 0; i < shard_count; i++) {
+                std::shared_lock lock(other.shards[i].m);
+                shards[i].map = other.shards[i].map;
+            }
+        }
 
-        if (!file.is_open()) return log_config("No bot data found, creating\n");
+        // Takes the slabs, pointers to values stay valid and now point into this map
+        sharded_map(sharded_map &&other) {
+            for (size_t i = 0; i < shard_count; i++) {
+                std::unique_lock lock(other.shards[i].m);
+                shards[i].map.swap(other.shards[i].map);
+            }
+        }
 
-        nlohmann::json j;
+        sharded_map &operator=(const sharded_map &other) {
+            if (this == &other) return *this;
+            for (size_t i = 0; i < shard_count; i++) {
+                std::unique_lock a(shards[i].m, std::defer_lock);
+                std::shared_lock b(other.shards[i].m, std::defer_lock);
+                std::lock(a, b);
+                shards[i].map = other.shards[i].map;
+            }
+            return *this;
+        }
 
-        if (!j.accept(file)) return log_config("Invalid bot data json data\n");
+        sharded_map &operator=(sharded_map &&other) {
+            if (this == &other) return *this;
+            for (size_t i = 0; i < shard_count; i++) {
+                std::scoped_lock lock(shards[i].m, other.shards[i].m);
+                shards[i].map.swap(other.shards[i].map);
+            }
+            return *this;
+        }
 
-        file.seekg(0);
-        file >> j;
+        mapped *get(const key_type &k) {
+            auto &s = shard_for(k);
+            std::shared_lock lock(s.m);
+            return util::get_or_null(s.map, k);
+        }
 
-        *(BotDataContainer*)this = j.template get<BotDataContainer>();
+        // Like get, fn sees the value before the shard lock is released
+        template<typename F>
+        mapped *get(const key_type &k, F &&fn) {
+            auto &s = shard_for(k);
+            std::shared_lock lock(s.m);
+            auto *v = util::get_or_null(s.map, k);
+            if (v) fn(*v);
+            return v;
+        }
 
-        log_config("Loaded bot data json\n");
+        // fn may write the value, it runs under the shard's exclusive lock
+        template<typename F>
+        mapped *update(const key_type &k, F &&fn) {
+            auto &s = shard_for(k);
+            std::unique_lock lock(s.m);
+            auto *v = util::get_or_null(s.map, k);
+            if (v) fn(*v);
+            return v;
+        }
 
-        return 0;
-    }
+        bool contains(const key_type &k) const {
+            auto &s = shard_for(k);
+            std::shared_lock lock(s.m);
+            return s.map.contains(k);
+        }
 
-    int save_data() {
-        if (!bot_data_file.size()) return log_config("No path for bot data\n");
+        template<typename ...Args>
+        std::pair<value_type*, bool> emplace(const key_type &k, Args &&...args) {
+            auto &s = shard_for(k);
+            std::unique_lock lock(s.m);
+            auto [iter, inserted] = s.map.emplace(std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple(std::forward<Args>(args)...));
+            return { &*iter, inserted };
+        }
 
-        std::ofstream file(bot_data_file);
+        size_t erase(const key_type &k) {
+            auto &s = shard_for(k);
+            std::unique_lock lock(s.m);
+            return s.map.erase(k);
+        }
 
-        if (!file.is_open()) return log_config("Could not open bot data path for saving\n");
+        // Erases k only if pred(value) holds, checked under the same lock
+        template<typename F>
+        size_t erase_if(const key_type &k, F &&pred) {
+            auto &s = shard_for(k);
+            std::unique_lock lock(s.m);
+            auto *v = util::get_or_null(s.map, k);
+            if (!v || !pred(*v)) return 0;
+            return s.map.erase(k);
+        }
 
-        nlohmann::json j = *(BotDataContainer*)this;
+        size_t size() const {
+            size_t sum = 0;
+            for (auto &s : shards) {
+                std::shared_lock lock(s.m);
+                sum += s.map.size();
+            }
+            return sum;
+        }
 
-        file << j;
+        void clear() {
+            for (auto &s : shards) {
+                std::unique_lock lock(s.m);
+                s.map.clear();
+            }
+        }
 
-        log_config("Saved bot data json\n");
+        size_t memory_usage() const {
+            size_t sum = 0;
+            for (auto &s : shards) {
+                std::shared_lock lock(s.m);
+                sum += s.map.memory_usage();
+            }
+            return sum;
+        }
 
-        return 0;
-    }
-};
+        // Holds every shard for reading so fn sees one consistent view, fn must not write to this map
+        template<typename F>
+        void for_each(F &&fn) const {
+            std::array<std::shared_lock<rw_mutex>, shard_count> locks;
+            for (size_t i = 0; i < shard_count; i++)
+                locks[i] = std::shared_lock<rw_mutex>(shards[i].m);
+            for (auto &s : shards)
+                for (auto &v : s.map)
+                    fn(v);
+        }
 
-#undef log
-#define log(format, ...) fprintf(stderr, format __VA_OPT__(,) __VA_ARGS__)
+        template<typename F>
+        void for_each(F &&fn) {
+            std::array<std::shared_lock<rw_mutex>, shard_count> locks;
+            for (size_t i = 0; i < shard_count; i++)
+                locks[i] = std::shared_lock<rw_mutex>(shards[i].m);
+            for (auto &s : shards)
+                for (auto &v : s.map)
+                    fn(v);
+        }
 
-struct Program : public BotData {
-    std::function<void(const dpp::confirmation_callback_t&)> confirmation_handler;
-    std::function<void(const dpp::ready_t&)> ready_handler;
-    std::function<void(const dpp::slashcommand_t&)> slashcommand_handler;
-    std::function<void(const dpp::guild_member_add_t&)> guild_user_add_handler;
-    std::function<void(const dpp::message_create_t&)> message_handler;
-    std::function<void(const dpp::button_click_t&)> button_click_handler;
+        private:
 
-    std::function<void(int)> signal_handler;
-    
-    bool did_init = false;
-    bool did_load = false;
+        std::array<shard, shard_count> shards;
 
-    Program() { }
+        // The slab index uses the low hash bits, shard on the high ones
+        shard &shard_for(const key_type &k) {
+            return shards[(hash_snowflake((uint64_t)k) >> 32) % shard_count];
+        }
 
-    virtual int init() {
-        confirmation_handler = std::bind(&Program::handle_confirm, this, std::placeholders::_1);
-        ready_handler = std::bind(&Program::handle_ready, this, std::placeholders::_1);
-        guild_user_add_handler = std::bind(&Program::handle_guild_user_add, this, std::placeholders::_1);
-        message_handler = std::bind(&Program::handle_message, this, std::placeholders::_1);
-        button_click_handler = std::bind(&Program::handle_button_click, this, std::placeholders::_1);
-        slashcommand_handler = std::bind(&Program::handle_slashcommand, this, std::placeholders::_1);
-        signal_handler = std::bind(&Program::handle_signal, this, std::placeholders::_1);
+        const shard &shard_for(const key_type &k) const {
+            return shards[(hash_snowflake((uint64_t)k) >> 32) % shard_count];
+        }
+    };
 
-        did_init = true;
-        return 0;
+    template<typename key, typename mapped, size_t shard_count>
+    void to_json(nlohmann::json &j, const sharded_map<key, mapped, shard_count> &map) {
+        j = nlohmann::json::array();
+        map.for_each([&j](auto &v) {
+            j.push_back({ v.first, v.second });
+        });
     }
 
-    virtual int load() {
-        if (!did_init)
-            if (this->init())
-                return -1;
+    template<typename key, typename mapped, size_t shard_count>
+    void from_json(const nlohmann::json &j, sharded_map<key, mapped, shard_count> &map) {
+        map.clear();
+        for (auto &e : j)
+            map.emplace(e.at(0).template get<key>(), e.at(1).template get<mapped>());
+    }
 
-        load_config();
-        load_data();
+    using resumer = std::function<void(std::coroutine_handle<>)>;
 
-        if (load_token())
-            handle_error("No token supplied");
+    // Set while a thread runs work that has to continue where it started (a guild's
+    // executor strand), empty resumes on whichever thread completes the result
+    inline thread_local resumer resume_on;
 
-        new (&bot) dpp::cluster(token, dpp::i_guilds | dpp::i_default_intents | dpp::i_guild_members | dpp::i_message_content);
+    template<typename T>
+    struct shared_result {
+        std::mutex m;
+        bool done = false;
+        T value{};
+        std::vector<std::pair<std::coroutine_handle<>, resumer>> waiters;
+
+        void set(T v) {
+            std::vector<std::pair<std::coroutine_handle<>, resumer>> resume;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                value = std::move(v);
+                done = true;
+                resume.swap(waiters);
+            }
+            for (auto &[h, on] : resume) {
+                if (on) on(h);
+                else h.resume();
+            }
+        }
+    };
 
-        bot.on_ready(ready_handler);
-        bot.on_guild_member_add(guild_user_add_handler);
-        bot.on_message_create(message_handler);
-        bot.on_button_click(button_click_handler);
-        bot.on_slashcommand(slashcommand_handler);
+    template<typename T>
+    struct shared_awaiter {
+        std::shared_ptr<shared_result<T>> result;
 
-        logs("Connecting");
+        bool await_ready() {
+            std::unique_lock<std::mutex> lock(result->m);
+            return result->done;
+        }
 
-        did_load = true;
-        return 0;
-    }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::unique_lock<std::mutex> lock(result->m);
+            if (result->done) return false;
+            result->waiters.emplace_back(h, resume_on);
+            return true;
+        }
 
-    virtual int save() {
-        save_data();
+        T await_resume() {
+            return result->value;
+        }
+    };
+
+    // Merges concurrent requests for the same key into one in-flight fetch,
+    // every co_await on the returned awaiter receives the same result
+    template<typename key_type, typename T>
+    struct coalescer {
+        using done_type = std::function<void(T)>;
+
+        std::mutex m;
+        std::map<key_type, std::shared_ptr<shared_result<T>>> inflight;
+
+        template<typename F>
+        shared_awaiter<T> get(const key_type &key, F &&start) {
+            std::shared_ptr<shared_result<T>> result;
+            bool first = false;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                auto &slot = inflight[key];
+                if (!slot) {
+                    slot = std::make_shared<shared_result<T>>();
+                    first = true;
+                }
+                result = slot;
+            }
+            if (first)
+                start(done_type([this, key, result](T value) {
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        inflight.erase(key);
+                    }
+                    result->set(std::move(value));
+                }));
+            return { result };
+        }
+
+        size_t pending() {
+            std::unique_lock<std::mutex> lock(m);
+            return inflight.size();
+        }
+    };
+
+    constexpr uint32_t fnv1a(std::string_view s, uint32_t hash = 2166136261u) {
+        for (char c : s) {
+            hash ^= (uint8_t)c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    // Slot table for a fixed set of two part keys. The seed is searched at compile
+    // time until every key lands in its own slot, so a lookup is one hash and one compare
+    template<size_t N>
+    struct perfect_hash {
+        static constexpr size_t slot_count = std::bit_ceil(N * 2);
+
+        uint32_t seed = 0;
+        std::array<uint16_t, slot_count> slots {};
+
+        static constexpr size_t slot(uint32_t seed, std::string_view a, std::string_view b) {
+            uint32_t hash = fnv1a(b, fnv1a("/", fnv1a(a, 2166136261u ^ seed)));
+            return (hash ^ hash >> 16) & (slot_count - 1);
+        }
+
+        template<typename T, typename F>
+        constexpr perfect_hash(const std::array<T, N> &items, F &&key) {
+            for (; seed < 4096; seed++) {
+                slots = {};
+                bool ok = true;
+                for (size_t i = 0; i < N && ok; i++) {
+                    auto [a, b] = key(items[i]);
+                    auto &s = slots[slot(seed, a, b)];
+                    ok = !s;
+                    s = i + 1;
+                }
+                if (ok)
+                    return;
+            }
+            throw "perfect_hash: duplicate keys";
+        }
+
+        template<typename T, typename F>
+        constexpr const T *find(const std::array<T, N> &items, F &&key, std::string_view a, std::string_view b) const {
+            size_t i = slots[slot(seed, a, b)];
+            if (!i)
+                return nullptr;
+            auto [ka, kb] = key(items[i - 1]);
+            return ka == a && kb == b ? &items[i - 1] : nullptr;
+        }
+    };
+
+    constexpr uint8_t fold_ascii(uint8_t c) {
+        return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    // Case-insensitive match of the whole text, '*' is any run of bytes and '?' any one byte
+    inline bool glob_match(std::string_view pattern, std::string_view text) {
+        size_t p = 0, t = 0;
+        size_t star = std::string_view::npos, mark = 0;
+
+        while (t < text.size()) {
+            if (p < pattern.size() && pattern[p] == '*') {
+                star = p++;
+                mark = t;
+            } else if (p < pattern.size() && (pattern[p] == '?' || fold_ascii(pattern[p]) == fold_ascii(text[t]))) {
+                p++;
+                t++;
+            } else if (star != std::string_view::npos) {
+                p = star + 1;
+                t = ++mark;
+            } else {
+                return false;
+            }
+        }
+
+        while (p < pattern.size() && pattern[p] == '*')
+            p++;
+        return p == pattern.size();
+    }
+
+    /*
+     * Aho-Corasick automaton over ASCII case folded bytes. Finds every added
+     * pattern in one pass over the text however many patterns there are.
+     * Patterns are added, build() is called once, after that match() only
+     * reads and can run from any number of threads.
+     */
+    struct aho_corasick {
+        void add(std::string_view pattern, uint32_t id) {
+            if (pattern.empty()) return;
+
+            uint32_t n = 0;
+            for (char c : pattern) {
+                auto [iter, inserted] = trie[n].try_emplace(fold_ascii(c), (uint32_t)trie.size());
+                if (inserted)
+                    trie.emplace_back();
+                n = iter->second;
+            }
+            ends.resize(trie.size());
+            ends[n].push_back({ id, (uint32_t)pattern.size() });
+        }
+
+        void build() {
+            ends.resize(trie.size());
+            nodes.assign(trie.size(), node());
+            edges.clear();
+            outputs.clear();
+            root.fill(0);
+
+            // Breadth first so every fail link points at a node that is already done
+            std::vector<uint32_t> queue;
+            for (auto [c, child] : trie[0]) {
+                root[c] = child;
+                queue.push_back(child);
+            }
+
+            for (size_t q = 0; q < queue.size(); q++) {
+                uint32_t u = queue[q];
+                for (auto [c, v] : trie[u]) {
+                    uint32_t f = nodes[u].fail;
+                    while (f && !trie[f].count(c))
+                        f = nodes[f].fail;
+                    auto iter = trie[f].find(c);
+                    nodes[v].fail = iter != trie[f].end() ? iter->second : 0;
+                    queue.push_back(v);
+                }
+                uint32_t f = nodes[u].fail;
+                nodes[u].dict = ends[f].size() ? f : nodes[f].dict;
+            }
+
+            for (size_t n = 0; n < trie.size(); n++) {
+                nodes[n].edges = edges.size();
+                nodes[n].edge_count = trie[n].size();
+                for (auto [c, child] : trie[n])
+                    edges.push_back({ c, child });
+
+                nodes[n].outputs = outputs.size();
+                nodes[n].output_count = ends[n].size();
+                outputs.insert(outputs.end(), ends[n].begin(), ends[n].end());
+            }
+
+            trie.assign(1, {});
+            ends.clear();
+        }
+
+        // fn(id, begin) for every occurrence, begin is the offset of the match in text
+        template<typename F>
+        void match(std::string_view text, F &&fn) const {
+            uint32_t state = 0;
+
+            for (size_t i = 0; i < text.size(); i++) {
+                uint8_t c = fold_ascii(text[i]);
+
+                while (state) {
+                    uint32_t next = step(state, c);
+                    if (next) {
+                        state = next;
+                        break;
+                    }
+                    state = nodes[state].fail;
+                }
+                if (!state)
+                    state = root[c];
+
+                for (uint32_t n = nodes[state].output_count ? state : nodes[state].dict; n; n = nodes[n].dict)
+                    for (uint32_t k = 0; k < nodes[n].output_count; k++) {
+                        auto &out = outputs[nodes[n].outputs + k];
+                        fn(out.id, i + 1 - out.length);
+                    }
+            }
+        }
+
+        size_t size() const { return nodes.size(); }
+
+        size_t memory_usage() const {
+            return nodes.capacity() * sizeof(node) + edges.capacity() * sizeof(edge) + outputs.capacity() * sizeof(output);
+        }
+
+        private:
+
+        struct node {
+            uint32_t fail = 0;
+            // Nearest node on the fail chain that ends a pattern, 0 when there is none
+            uint32_t dict = 0;
+            uint32_t edges = 0;
+            uint32_t edge_count = 0;
+            uint32_t outputs = 0;
+            uint32_t output_count = 0;
+        };
+
+        struct edge {
+            uint8_t byte;
+            uint32_t to;
+        };
+
+        struct output {
+            uint32_t id;
+            uint32_t length;
+        };
+
+        // Only used while adding, the built automaton is flat arrays
+        std::vector<std::map<uint8_t, uint32_t>> trie = std::vector<std::map<uint8_t, uint32_t>>(1);
+        std::vector<std::vector<output>> ends;
+
+        std::vector<node> nodes = std::vector<node>(1);
+        std::vector<edge> edges;
+        std::vector<output> outputs;
+        std::array<uint32_t, 256> root {};
+
+        uint32_t step(uint32_t state, uint8_t c) const {
+            auto first = edges.begin() + nodes[state].edges;
+            auto last = first + nodes[state].edge_count;
+            auto iter = std::lower_bound(first, last, c, [](const edge &e, uint8_t c) { return e.byte < c; });
+            return iter != last && iter->byte == c ? iter->to : 0;
+        }
+    };
+
+    // Short strings live inside the std::string itself
+    inline size_t string_heap_bytes(const std::string &s) {
+        return s.capacity() > 15 ? s.capacity() + 1 : 0;
+    }
+
+    /*
+     * Process wide pool of immutable strings. Cache entries repeat the same
+     * names a lot (role and channel names across guilds), so
+     * each distinct string is stored once and entries hold a pointer to it.
+     * Strings are never freed, the pool grows with the number of distinct names.
+     */
+    struct string_pool {
+        static string_pool &get() {
+            static string_pool pool;
+            return pool;
+        }
+
+        const std::string *intern(std::string_view s) {
+            if (s.empty()) return &empty;
+
+            auto &shard = shards[fnv1a(s) % shard_count];
+            {
+                std::shared_lock lock(shard.m);
+                auto iter = shard.strings.find(s);
+                if (iter != shard.strings.end()) return &*iter;
+            }
+
+            std::unique_lock lock(shard.m);
+            auto [iter, inserted] = shard.strings.emplace(s);
+            if (inserted) {
+                count++;
+                bytes += sizeof(std::string) + string_heap_bytes(*iter);
+            }
+            return &*iter;
+        }
+
+        const std::string *empty_string() const { return &empty; }
+
+        // Distinct strings and the bytes they take, set node overhead left out
+        std::atomic<size_t> count = 0;
+        std::atomic<size_t> bytes = 0;
+
+        private:
+
+        static constexpr size_t shard_count = 16;
+
+        struct shard {
+            std::shared_mutex m;
+            std::set<std::string, std::less<>> strings;
+        };
+
+        std::array<shard, shard_count> shards;
+        const std::string empty;
+    };
+
+    // Pointer to a pooled string, 8 bytes instead of a std::string per cache entry
+    struct istring {
+        istring():s(string_pool::get().empty_string()) { }
+        istring(std::string_view v):s(string_pool::get().intern(v)) { }
+        istring(const std::string &v):istring(std::string_view(v)) { }
+        istring(const char *v):istring(std::string_view(v)) { }
+
+        const std::string &str() const { return *s; }
+        std::string_view view() const { return *s; }
+        const char *c_str() const { return s->c_str(); }
+        size_t size() const { return s->size(); }
+        bool empty() const { return s->empty(); }
+
+        operator const std::string &() const { return *s; }
+
+        friend bool operator==(const istring &a, const istring &b) { return a.s == b.s; }
+        friend bool operator==(const istring &a, const std::string &b) { return *a.s == b; }
+        friend bool operator==(const istring &a, std::string_view b) { return *a.s == b; }
+        friend bool operator==(const istring &a, const char *b) { return *a.s == b; }
+
+        friend void to_json(nlohmann::json &j, const istring &v) {
+            j = v.str();
+        }
+
+        private:
+
+        const std::string *s;
+    };
+
+    enum log_level {
+        ll_trace,
+        ll_debug,
+        ll_info,
+        ll_warn,
+        ll_error
+    };
+
+    struct log_fields {
+        uint64_t guild = 0;
+        uint64_t user = 0;
+        const char *handler = nullptr;
+    };
+
+    struct log_record {
+        log_level level = ll_info;
+        log_fields fields;
+        std::chrono::system_clock::time_point time;
+        std::string text;
+    };
+
+    // Single producer ring owned by one logging thread, drained by the writer thread
+    struct log_ring {
+        static constexpr size_t capacity = 1024;
+
+        std::array<log_record, capacity> records;
+        alignas(64) std::atomic<size_t> head = 0;
+        alignas(64) std::atomic<size_t> tail = 0;
+        std::atomic<bool> orphaned = false;
+
+        bool push(log_record &&record) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == capacity)
+                return false;
+            records[h % capacity] = std::move(record);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        template<typename F>
+        size_t drain(F &&fn) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t h = head.load(std::memory_order_acquire);
+            size_t n = h - t;
+            for (; t != h; t++)
+                fn(records[t % capacity]);
+            tail.store(t, std::memory_order_release);
+            return n;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+    };
+
+    /*
+     * Event threads only format into their own ring, one background thread
+     * writes every ring out to stderr. A full ring drops the record instead
+     * of blocking, the writer reports how many were lost.
+     */
+    struct logger {
+        std::chrono::milliseconds idle_interval{5};
+
+        static logger &get() {
+            static logger instance;
+            return instance;
+        }
+
+        void write(log_record &&record) {
+            if (!local().push(std::move(record)))
+                dropped++;
+        }
+
+        ~logger() {
+            stopping = true;
+            if (writer.joinable())
+                writer.join();
+        }
+
+        private:
+
+        struct ring_owner {
+            std::shared_ptr<log_ring> ring;
+
+            ~ring_owner() {
+                if (ring) ring->orphaned = true;
+            }
+        };
+
+        std::mutex m;
+        std::vector<std::shared_ptr<log_ring>> rings;
+        std::atomic<bool> stopping = false;
+        std::atomic<uint64_t> dropped = 0;
+        std::thread writer;
+
+        logger() {
+            writer = std::thread(&logger::run, this);
+        }
+
+        log_ring &local() {
+            thread_local ring_owner owner;
+            if (!owner.ring) {
+                owner.ring = std::make_shared<log_ring>();
+                std::unique_lock<std::mutex> lock(m);
+                rings.push_back(owner.ring);
+            }
+            return *owner.ring;
+        }
+
+        static void format(std::string &out, const log_record &r) {
+            static constexpr const char *names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(r.time.time_since_epoch()).count();
+            time_t seconds = ms / 1000;
+            struct tm tm;
+            gmtime_r(&seconds, &tm);
+
+            char prefix[48];
+            size_t n = strftime(prefix, sizeof(prefix), "%F %T", &tm);
+            snprintf(prefix + n, sizeof(prefix) - n, ".%03d %s ", (int)(ms % 1000), names[r.level]);
+            out += prefix;
+
+            std::string_view text = r.text;
+            if (text.size() && text.back() == '\n')
+                text.remove_suffix(1);
+            out += text;
+
+            if (r.fields.guild) out += fmt::format(" guild={}", r.fields.guild);
+            if (r.fields.user) out += fmt::format(" user={}", r.fields.user);
+            if (r.fields.handler) out += fmt::format(" handler={}", r.fields.handler);
+            out += '\n';
+        }
+
+        size_t drain() {
+            std::vector<std::shared_ptr<log_ring>> current;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                std::erase_if(rings, [](auto &ring) { return ring->orphaned && ring->empty(); });
+                current = rings;
+            }
+
+            std::string out;
+            size_t n = 0;
+            for (auto &ring : current)
+                n += ring->drain([&out](const log_record &r) { format(out, r); });
+
+            if (uint64_t lost = dropped.exchange(0))
+                out += fmt::format("Dropped {} log records\n", lost);
+
+            if (out.size()) {
+                fwrite(out.data(), 1, out.size(), stderr);
+                fflush(stderr);
+            }
+            return n;
+        }
+
+        void run() {
+            while (!stopping)
+                if (!drain())
+                    std::this_thread::sleep_for(idle_interval);
+            drain();
+        }
+    };
+
+    inline int log_write(log_level level, log_fields fields, std::string text) {
+        int n = text.size();
+        logger::get().write({ level, fields, std::chrono::system_clock::now(), std::move(text) });
+        return n;
+    }
+
+    template<typename ...Args>
+    int log_printf(log_level level, log_fields fields, const char *format, Args &&...args) {
+        char buffer[512];
+        int n = snprintf(buffer, sizeof(buffer), format, args...);
+        if (n < 0) return n;
+        if ((size_t)n < sizeof(buffer))
+            return log_write(level, fields, std::string(buffer, n));
+
+        std::string text(n, '\0');
+        snprintf(text.data(), n + 1, format, args...);
+        return log_write(level, fields, std::move(text));
+    }
+
+    // Lets through at most per_second calls each second, for traces on hot paths
+    struct log_limiter {
+        uint32_t per_second;
+        std::atomic<uint64_t> window = 0;
+        std::atomic<uint32_t> count = 0;
+        std::atomic<uint64_t> suppressed = 0;
+
+        log_limiter(uint32_t limit):per_second(limit) { }
+
+        // Returns false when over the limit, skipped is set to the count suppressed in the last window
+        bool allow(uint64_t &skipped) {
+            uint64_t now = unix_now();
+            skipped = 0;
+            if (window.exchange(now) != now) {
+                count = 0;
+                skipped = suppressed.exchange(0);
+            }
+            if (count++ < per_second)
+                return true;
+            suppressed++;
+            return false;
+        }
+    };
+}
+
+// Levels below LOG_LEVEL compile out along with their arguments
+#ifndef LOG_LEVEL
+#define LOG_LEVEL util::ll_info
+#endif
+
+#undef log
+#define log_with(level, fields, format, ...) ((level) >= (LOG_LEVEL) ? util::log_printf(level, fields, format __VA_OPT__(,) __VA_ARGS__) : 0)
+#define log(format, ...) log_with(util::ll_info, util::log_fields(), format __VA_OPT__(,) __VA_ARGS__)
+
+struct UserData;
+struct GuildRoleData;
+struct GuildUserData;
+struct GuildData;
+
+// Set from ConfigData::cache_dpp_objects, entries then also keep the DPP object they were built from
+inline bool keep_dpp_objects = false;
+
+/*
+ * Cache entries keep only the fields the bot reads. Role and channel names
+ * repeat across guilds and are interned, user names and nicknames are mostly
+ * unique and stay plain strings so evicted users free them.
+ * get_mention() and the role helpers stand in for the DPP object methods.
+ */
+struct UserData {
+    dpp::snowflake id;
+    std::string username;
+    std::string display_name;
+
+    uint64_t fetched_at = 0;
+
+    // CLOCK bit, set on every use and cleared by each eviction sweep
+    util::copyable_atomic<bool> referenced = true;
+
+    std::shared_ptr<const dpp::user> full;
+
+    void assign(const dpp::user &user) {
+        id = user.id;
+        username = user.username;
+        display_name = user.global_name;
+        full = keep_dpp_objects ? std::make_shared<const dpp::user>(user) : nullptr;
+    }
+
+    std::string get_mention() const {
+        return fmt::format("<@{}>", (uint64_t)id);
+    }
+
+    void touch() {
+        if (!referenced.load(std::memory_order_relaxed))
+            referenced.store(true, std::memory_order_relaxed);
+    }
+
+    // Heap bytes owned by this entry, interned strings are counted by the pool
+    size_t heap_bytes() const {
+        return util::string_heap_bytes(username) + util::string_heap_bytes(display_name) + (full ? sizeof(dpp::user) : 0);
+    }
+
+    nlohmann::json cache_json() const {
+        return { { "username", username }, { "display_name", display_name }, { "fetched_at", fetched_at } };
+    }
+
+    void restore(const dpp::snowflake user_id, const nlohmann::json &j) {
+        id = user_id;
+        username = j.value("username", "");
+        display_name = j.value("display_name", "");
+        fetched_at = j.value("fetched_at", (uint64_t)0);
+    }
+
+    UserData() { }
+    UserData(const dpp::user &user) { assign(user); }
+};
+
+struct GuildRoleData {
+    GuildData *guild;
+
+    dpp::snowflake id;
+    util::istring name;
+
+    uint64_t fetched_at = 0;
+
+    std::shared_ptr<const dpp::role> full;
+
+    void assign(const dpp::role &role) {
+        id = role.id;
+        name = role.name;
+        full = keep_dpp_objects ? std::make_shared<const dpp::role>(role) : nullptr;
+    }
+
+    std::string get_mention() const {
+        return fmt::format("<@&{}>", (uint64_t)id);
+    }
+
+    size_t heap_bytes() const {
+        return full ? sizeof(dpp::role) : 0;
+    }
+
+    nlohmann::json cache_json() const {
+        return { { "name", name }, { "fetched_at", fetched_at } };
+    }
+
+    void restore(const dpp::snowflake role_id, const dpp::snowflake guild_id, const nlohmann::json &j) {
+        id = role_id;
+        name = j.value("name", "");
+        fetched_at = j.value("fetched_at", (uint64_t)0);
+    }
+
+    GuildRoleData():guild(0),id(0) {}
+    GuildRoleData(GuildData *guild, const dpp::role &role):guild(guild) { assign(role); }
+
+    friend bool operator==(const GuildRoleData &a, const std::string &b) {
+        return a.name == b;
+    }
+};
+
+struct GuildUserData {
+    UserData *user;
+    GuildData *guild;
+
+    dpp::snowflake user_id;
+    std::string nickname;
+    std::vector<dpp::snowflake> roles;
+
+    uint64_t fetched_at = 0;
+
+    util::copyable_atomic<bool> referenced = true;
+
+    std::shared_ptr<const dpp::guild_member> full;
+
+    void assign(const dpp::guild_member &member) {
+        user_id = member.user_id;
+        nickname = member.get_nickname();
+        roles.assign(member.get_roles().begin(), member.get_roles().end());
+        full = keep_dpp_objects ? std::make_shared<const dpp::guild_member>(member) : nullptr;
+    }
+
+    const std::vector<dpp::snowflake> &get_roles() const {
+        return roles;
+    }
+
+    bool has_role(dpp::snowflake role_id) const {
+        return std::find(roles.begin(), roles.end(), role_id) != roles.end();
+    }
+
+    void add_role(dpp::snowflake role_id) {
+        if (!has_role(role_id))
+            roles.push_back(role_id);
+    }
+
+    void remove_role(dpp::snowflake role_id) {
+        std::erase(roles, role_id);
+    }
+
+    void touch() {
+        if (!referenced.load(std::memory_order_relaxed))
+            referenced.store(true, std::memory_order_relaxed);
+    }
+
+    size_t heap_bytes() const {
+        return util::string_heap_bytes(nickname) + roles.capacity() * sizeof(dpp::snowflake) + (full ? sizeof(dpp::guild_member) : 0);
+    }
+
+    nlohmann::json cache_json() const {
+        std::vector<uint64_t> ids(roles.begin(), roles.end());
+        return { { "nickname", nickname }, { "roles", ids }, { "fetched_at", fetched_at } };
+    }
+
+    void restore(const dpp::snowflake user_id, const dpp::snowflake guild_id, const nlohmann::json &j) {
+        this->user_id = user_id;
+        nickname = j.value("nickname", "");
+        if (j.contains("roles"))
+            for (auto &r : j["roles"])
+                roles.push_back(r.template get<uint64_t>());
+        fetched_at = j.value("fetched_at", (uint64_t)0);
+    }
+
+    GuildUserData():user(0),guild(0) { }
+    GuildUserData(UserData *user, GuildData *guild, const dpp::guild_member &guild_member):user(user),guild(guild) { assign(guild_member); }
+};
+
+struct ChannelData {
+    dpp::snowflake id;
+    dpp::snowflake guild_id;
+    util::istring name;
+
+    uint64_t fetched_at = 0;
+
+    std::shared_ptr<const dpp::channel> full;
+
+    void assign(const dpp::channel &channel) {
+        id = channel.id;
+        guild_id = channel.guild_id;
+        name = channel.name;
+        full = keep_dpp_objects ? std::make_shared<const dpp::channel>(channel) : nullptr;
+    }
+
+    std::string get_mention() const {
+        return fmt::format("<#{}>", (uint64_t)id);
+    }
+
+    size_t heap_bytes() const {
+        return full ? sizeof(dpp::channel) : 0;
+    }
+
+    nlohmann::json cache_json() const {
+        return { { "name", name }, { "guild_id", (uint64_t)guild_id }, { "fetched_at", fetched_at } };
+    }
+
+    void restore(const dpp::snowflake channel_id, const nlohmann::json &j) {
+        id = channel_id;
+        name = j.value("name", "");
+        guild_id = j.value("guild_id", (uint64_t)0);
+        fetched_at = j.value("fetched_at", (uint64_t)0);
+    }
+
+    ChannelData() { }
+    ChannelData(const dpp::channel &channel) { assign(channel); }
+};
+
+struct GuildChannelData {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(GuildChannelData, id, bot_allowed);
+
+    nlohmann::json cache_json() const {
+        return *this;
+    }
+
+    ChannelData *channel;
+    GuildData *guild;
+
+    util::istring name;
+    our_snowflake id;
+
+    bool bot_allowed;
+
+    GuildChannelData():guild(0),channel(0),bot_allowed(1) { }
+    GuildChannelData(GuildData *guild_data, ChannelData *channel_data):guild(guild_data),channel(channel_data),bot_allowed(1) { }
+};
+
+// Progress of /verify all or /verify none, persisted so a restart resumes the job
+struct VerifyJobData {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(VerifyJobData, mode, cursor, changed, skipped, started_at, failed);
+
+    std::string mode;
+    uint64_t cursor = 0;
+    uint64_t changed = 0;
+    uint64_t skipped = 0;
+    uint64_t started_at = 0;
+
+    // Members whose role change failed, retried once the member list is done
+    std::vector<uint64_t> failed;
+
+    // Interaction token of the command, only usable for 15 minutes. Kept in memory, never persisted
+    std::string token;
+};
+
+// A trigger and what it does. kind is "keyword" (whole words anywhere), "prefix" or "glob" (whole message)
+struct AutoResponderData {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(AutoResponderData, kind, pattern, reply, role, action);
+
+    std::string kind;
+    std::string pattern;
+
+    // Posted in the channel when not empty
+    std::string reply;
+
+    // Given to or taken from the author, action is "add" or "remove"
+    our_snowflake role;
+    std::string action;
+
+    void set_field(const std::string &key, const util::json_scalar &value) {
+        if (key == "kind") util::scalar_to(value, kind);
+        else if (key == "pattern") util::scalar_to(value, pattern);
+        else if (key == "reply") util::scalar_to(value, reply);
+        else if (key == "role") util::scalar_to(value, role);
+        else if (key == "action") util::scalar_to(value, action);
+    }
+};
+
+/*
+ * A guild's rules compiled into one automaton, so a message is scanned once
+ * whatever the number of rules. Keywords and prefixes are keyed by their
+ * pattern, globs by their longest literal run and confirmed with glob_match.
+ * Globs with no literal at all are tried on every message.
+ */
+struct AutoResponder {
+    static constexpr size_t max_rules = 5000;
+    static constexpr size_t max_pattern = 100;
+
+    // Rules fired by one message, the rest are ignored so a message can't set off a flood
+    static constexpr size_t max_actions = 5;
+
+    std::vector<AutoResponderData> rules;
+
+    AutoResponder(std::vector<AutoResponderData> rules):rules(std::move(rules)) {
+        for (uint32_t i = 0; i < this->rules.size(); i++) {
+            auto &rule = this->rules[i];
+            if (rule.kind != "glob")
+                automaton.add(rule.pattern, i);
+            else if (auto literal = longest_literal(rule.pattern); literal.size())
+                automaton.add(literal, i);
+            else
+                always.push_back(i);
+        }
+        automaton.build();
+    }
+
+    std::vector<const AutoResponderData*> match(std::string_view text) const {
+        std::vector<uint32_t> hits, globs;
+
+        automaton.match(text, [&](uint32_t i, size_t begin) {
+            auto &rule = rules[i];
+            if (rule.kind == "glob")
+                globs.push_back(i);
+            else if (rule.kind == "prefix" ? begin == 0 : is_boundary(text, begin - 1) && is_boundary(text, begin + rule.pattern.size()))
+                hits.push_back(i);
+        });
+
+        // A literal repeated in the message only queues its glob again, each glob runs once
+        std::sort(globs.begin(), globs.end());
+        globs.erase(std::unique(globs.begin(), globs.end()), globs.end());
+        for (auto i : globs)
+            if (util::glob_match(rules[i].pattern, text))
+                hits.push_back(i);
+
+        for (auto i : always)
+            if (util::glob_match(rules[i].pattern, text))
+                hits.push_back(i);
+
+        std::sort(hits.begin(), hits.end());
+        hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+        if (hits.size() > max_actions)
+            hits.resize(max_actions);
+
+        std::vector<const AutoResponderData*> out;
+        for (auto i : hits)
+            out.push_back(&rules[i]);
+        return out;
+    }
+
+    size_t memory_usage() const {
+        size_t sum = sizeof(*this) + automaton.memory_usage() + always.capacity() * sizeof(uint32_t);
+        for (auto &rule : rules)
+            sum += sizeof(rule) + rule.kind.capacity() + rule.pattern.capacity() + rule.reply.capacity() + rule.action.capacity();
+        return sum;
+    }
+
+    private:
+
+    util::aho_corasick automaton;
+    std::vector<uint32_t> always;
+
+    static std::string_view longest_literal(std::string_view glob) {
+        std::string_view best;
+        size_t start = 0;
+        for (size_t i = 0; i <= glob.size(); i++) {
+            if (i < glob.size() && glob[i] != '*' && glob[i] != '?') continue;
+            if (i - start > best.size())
+                best = glob.substr(start, i - start);
+            start = i + 1;
+        }
+        return best;
+    }
+
+    // Offsets outside the text count as boundaries, bytes of multibyte characters don't
+    static bool is_boundary(std::string_view text, size_t i) {
+        if (i >= text.size()) return true;
+        uint8_t c = text[i];
+        return c < 0x80 && !isalnum(c) && c != '_';
+    }
+};
+
+// Copyable handle to the compiled rules, a change swaps in a new AutoResponder while readers keep theirs
+struct AutoResponderSet {
+    std::shared_ptr<const AutoResponder> get() const {
+        std::shared_lock lock(m);
+        return current;
+    }
+
+    void set(std::vector<AutoResponderData> rules) {
+        auto next = rules.empty() ? nullptr : std::make_shared<const AutoResponder>(std::move(rules));
+        std::unique_lock lock(m);
+        current = std::move(next);
+    }
+
+    std::vector<AutoResponderData> rules() const {
+        auto c = get();
+        return c ? c->rules : std::vector<AutoResponderData>();
+    }
+
+    // fn edits a copy of the rules and returns false to keep the current ones, concurrent edits don't overwrite each other
+    template<typename F>
+    bool update(F &&fn) {
+        std::unique_lock<std::mutex> lock(update_lock);
+        auto next = rules();
+        if (!fn(next))
+            return false;
+        set(std::move(next));
+        return true;
+    }
+
+    AutoResponderSet() { }
+    AutoResponderSet(const AutoResponderSet &other):current(other.get()) { }
+    AutoResponderSet &operator=(const AutoResponderSet &other) {
+        auto c = other.get();
+        std::unique_lock lock(m);
+        current = std::move(c);
+        return *this;
+    }
+
+    friend void to_json(nlohmann::json &j, const AutoResponderSet &set) {
+        j = set.rules();
+    }
+
+    friend void from_json(const nlohmann::json &j, AutoResponderSet &set) {
+        set.set(j.is_array() ? j.template get<std::vector<AutoResponderData>>() : std::vector<AutoResponderData>());
+    }
+
+    private:
+
+    mutable util::rw_mutex m;
+    std::mutex update_lock;
+    std::shared_ptr<const AutoResponder> current;
+};
+
+struct GuildData {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(GuildData, id, name, verify_ephemeral, interact_ephemeral, welcome_channel, verify_role, bot_operator_role, responders);
+
+    dpp::guild cached;
+
+    util::sharded_map<dpp::snowflake, GuildRoleData, 4> roles;
+    util::sharded_map<dpp::snowflake, GuildUserData, 4> users;
+    util::sharded_map<dpp::snowflake, GuildChannelData, 4> channels;
+
+    /*
+     * Role names are not unique on Discord, equal names are ordered by id so the lowest id wins like the old
+     * scan. Keys point into the string pool, values into roles, so a copied or moved GuildData starts with a
+     * stale index that is rebuilt on first lookup.
+     */
+    struct role_name_index {
+        std::map<std::pair<std::string_view, uint64_t>, GuildRoleData*> names;
+        mutable util::rw_mutex lock;
+        bool stale = false;
+
+        role_name_index() { }
+        role_name_index(const role_name_index &):stale(true) { }
+
+        role_name_index &operator=(const role_name_index &) {
+            std::unique_lock l(lock);
+            names.clear();
+            stale = true;
+            return *this;
+        }
+    };
+
+    role_name_index role_names;
+
+    our_snowflake welcome_channel;
+    our_snowflake verify_role;
+    our_snowflake bot_operator_role;
+
+    bool verify_ephemeral;
+    bool interact_ephemeral;
+
+    util::copyable_atomic<bool> members_synced = false;
+    util::copyable_atomic<bool> members_syncing = false;
+    util::copyable_atomic<bool> roles_synced = false;
+
+    util::copyable_atomic<uint64_t> members_fetched_at = 0;
+    util::copyable_atomic<uint64_t> roles_fetched_at = 0;
+
+    VerifyJobData verify_job;
+    mutable util::rw_mutex verify_job_lock;
+    util::copyable_atomic<bool> verify_running = false;
+
+    AutoResponderSet responders;
+
+    std::string name;
+    our_snowflake id;
+
+    GuildRoleData* get_role(const std::string &text) {
+        return find_role(text);
+    }
+
+    GuildRoleData* find_role(std::string_view text) {
+        {
+            std::shared_lock lock(role_names.lock);
+            if (!role_names.stale) {
+                auto iter = role_names.names.lower_bound({ text, 0 });
+                if (iter == role_names.names.end() || iter->first.first != text) return nullptr;
+                return iter->second;
+            }
+        }
+        reindex_roles();
+        return find_role(text);
+    }
+
+    void reindex_roles() {
+        std::unique_lock lock(role_names.lock);
+        if (!role_names.stale) return;
+        role_names.names.clear();
+        roles.for_each([this](auto &pair) { role_names.names.try_emplace({ pair.second.name.view(), (uint64_t)pair.second.id }, &pair.second); });
+        role_names.stale = false;
+    }
+
+    // A stale index picks the role up when it is rebuilt
+    void index_role(GuildRoleData *role) {
+        std::unique_lock lock(role_names.lock);
+        if (role_names.stale) return;
+        role_names.names.try_emplace({ role->name.view(), (uint64_t)role->id }, role);
+    }
+
+    void unindex_role(GuildRoleData *role) {
+        std::unique_lock lock(role_names.lock);
+        auto iter = role_names.names.find({ role->name.view(), (uint64_t)role->id });
+        if (iter != role_names.names.end() && iter->second == role)
+            role_names.names.erase(iter);
+    }
+
+    bool erase_role(const dpp::snowflake &role_id) {
+        auto *role = get_role(role_id);
+        if (!role) return false;
+        unindex_role(role);
+        roles.erase(role_id);
+        return true;
+    }
+
+    GuildRoleData* get_role(const dpp::snowflake &role_id) {
+        return util::get_or_null(roles, role_id);
+    }
+
+    // Marked used under the shard lock, an eviction sweep can't free it between lookup and touch
+    GuildUserData* get_user(const dpp::snowflake &user_id) {
+        return users.get(user_id, [](auto &member) { member.touch(); });
+    }
+
+    GuildChannelData* get_channel(const dpp::snowflake &channel_id) {
+        return util::get_or_null(channels, channel_id);
+    }
+
+    struct memory_stats {
+        size_t members = 0;
+        size_t roles = 0;
+        size_t channels = 0;
+
+        size_t member_bytes = 0;
+        size_t role_bytes = 0;
+        size_t channel_bytes = 0;
+        size_t other_bytes = 0;
+
+        size_t total() const {
+            return member_bytes + role_bytes + channel_bytes + other_bytes;
+        }
+    };
+
+    // Approximate bytes held by this guild, interned names are shared between guilds and counted by the pool
+    memory_stats memory_usage() const {
+        memory_stats m;
+
+        m.members = users.size();
+        m.member_bytes = users.memory_usage();
+        users.for_each([&m](auto &pair) { m.member_bytes += pair.second.heap_bytes(); });
+
+        m.roles = roles.size();
+        m.role_bytes = roles.memory_usage();
+        roles.for_each([&m](auto &pair) { m.role_bytes += pair.second.heap_bytes(); });
+        {
+            // Red-black tree nodes carry three pointers and a color next to the value
+            std::shared_lock lock(role_names.lock);
+            m.role_bytes += role_names.names.size() * (sizeof(decltype(role_names.names)::value_type) + 4 * sizeof(void*));
+        }
+
+        m.channels = channels.size();
+        m.channel_bytes = channels.memory_usage();
+
+        m.other_bytes = sizeof(GuildData) + name.capacity()
+            + (cached.roles.capacity() + cached.channels.capacity() + cached.threads.capacity() + cached.emojis.capacity()) * sizeof(dpp::snowflake)
+            + cached.members.size() * sizeof(decltype(cached.members)::value_type);
+        if (auto responder = responders.get())
+            m.other_bytes += responder->memory_usage();
+
+        return m;
+    }
+
+    void set_field(const std::string &key, const util::json_scalar &value) {
+        if (key == "id") util::scalar_to(value, id);
+        else if (key == "name") util::scalar_to(value, name);
+        else if (key == "verify_ephemeral") util::scalar_to(value, verify_ephemeral);
+        else if (key == "interact_ephemeral") util::scalar_to(value, interact_ephemeral);
+        else if (key == "welcome_channel") util::scalar_to(value, welcome_channel);
+        else if (key == "verify_role") util::scalar_to(value, verify_role);
+        else if (key == "bot_operator_role") util::scalar_to(value, bot_operator_role);
+    }
+
+    // Cached Discord state, kept out of the config JSON and stored only in the binary snapshot
+    nlohmann::json cache_json() const {
+        auto entries = [](const auto &map) {
+            auto out = nlohmann::json::array();
+            map.for_each([&out](auto &pair) {
+                out.push_back({ (uint64_t)pair.first, pair.second.cache_json() });
+            });
+            return out;
+        };
+
+        return {
+            { "members_fetched_at", members_fetched_at.load() },
+            { "roles_fetched_at", roles_fetched_at.load() },
+            { "roles", entries(roles) },
+            { "users", entries(users) },
+            { "channels", entries(channels) }
+        };
+    }
+
+    VerifyJobData get_verify_job() const {
+        std::shared_lock lock(verify_job_lock);
+        return verify_job;
+    }
+
+    void set_verify_job(const VerifyJobData &job) {
+        std::unique_lock lock(verify_job_lock);
+        verify_job = job;
+    }
+
+    // Copies the persisted fields, leaves the caches alone
+    void copy_config(const GuildData &other) {
+        id = other.id;
+        name = other.name;
+        verify_ephemeral = other.verify_ephemeral;
+        interact_ephemeral = other.interact_ephemeral;
+        welcome_channel = other.welcome_channel;
+        verify_role = other.verify_role;
+        bot_operator_role = other.bot_operator_role;
+        responders = other.responders;
+    }
+
+    GuildData():verify_ephemeral(1),interact_ephemeral(1) { }
+    GuildData(const dpp::guild &guild):cached(guild),verify_ephemeral(1),interact_ephemeral(1) { }
+};
+
+struct ConfigData {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ConfigData, token_file, token, config_data_file, bot_data_file, bot_snapshot_file, pool_size, journal_flush_ms, journal_compact_bytes, cache_ttl, welcome_window, metrics_file, metrics_interval, shard_count, cluster_id, cluster_count, cache_dpp_objects, cache_max_entries, cache_max_bytes, cache_sweep_interval);
+
+    std::string token_file;
+    std::string token;
+
+    std::string bot_data_file;
+    std::string bot_snapshot_file;
+    std::string config_data_file;
+
+    // Threads handling guild events, 0 uses one per core
+    uint32_t pool_size;
+
+    uint32_t journal_flush_ms;
+    uint64_t journal_compact_bytes;
+
+    // Seconds before a cached user, channel, member list or role table is refetched in the background
+    uint64_t cache_ttl;
+
+    /*
+     * Caps on cached users plus members, 0 is no cap. The byte cap uses the
+     * same estimate as /info memory. Entries unused for a whole sweep interval
+     * are evicted until under both, guild config, roles and channels never are.
+     */
+    uint64_t cache_max_entries;
+    uint64_t cache_max_bytes;
+    uint32_t cache_sweep_interval;
+
+    // Seconds joins are collected before one welcome post greets them all
+    uint32_t welcome_window;
+
+    // Prometheus text file rewritten every metrics_interval seconds, empty disables it
+    std::string metrics_file;
+    uint32_t metrics_interval;
+
+    /*
+     * Several processes can split the guilds. Discord puts a guild on shard
+     * (id >> 22) % shard_count and DPP starts the shards where
+     * shard % cluster_count == cluster_id. shard_count 0 takes Discord's
+     * recommendation and only works with a single cluster.
+     */
+    uint32_t shard_count;
+    uint32_t cluster_id;
+    uint32_t cluster_count;
+
+    // Keep the full DPP object next to each cached user, member, role and channel, costs several times the memory
+    bool cache_dpp_objects;
+
+    bool is_partitioned() const {
+        return cluster_count > 1;
+    }
+
+    uint32_t shard_of(dpp::snowflake guild_id) const {
+        return shard_count ? (uint32_t)(((uint64_t)guild_id >> 22) % shard_count) : 0;
+    }
+
+    bool owns_guild(dpp::snowflake guild_id) const {
+        return !is_partitioned() || shard_of(guild_id) % cluster_count == cluster_id;
+    }
+
+    // data.bin becomes data.cluster-1-of-4.bin, so processes sharing a directory keep their own files
+    std::string partition_path(const std::string &path) const {
+        if (!is_partitioned() || path.empty()) return path;
+        std::filesystem::path p(path);
+        auto name = fmt::format("{}.cluster-{}-of-{}{}", p.stem().string(), cluster_id, cluster_count, p.extension().string());
+        return p.replace_filename(name).string();
+    }
+
+    // Loops sleep for these between runs, 0 would spin
+    int check_intervals() {
+        if (!metrics_interval) return log_config("metrics_interval must be at least 1\n");
+        if (!cache_sweep_interval) return log_config("cache_sweep_interval must be at least 1\n");
+        if (!welcome_window) return log_config("welcome_window must be at least 1\n");
+        return 0;
+    }
+
+    int check_sharding() {
+        if (!is_partitioned()) return 0;
+        if (!shard_count) return log_config("shard_count must be set when cluster_count is above 1\n");
+        if (cluster_id >= cluster_count) return log_config(fmt::format("cluster_id {} is not below cluster_count {}\n", cluster_id, cluster_count));
+        if (shard_count < cluster_count) return log_config(fmt::format("{} shards can't be split over {} clusters\n", shard_count, cluster_count));
+        return 0;
+    }
+
+    int load_config() {
+        if (!config_data_file.size()) return log_config("No path for config data\n");
+
+        std::string content;
+
+        if (util::read_file(config_data_file, content)) {
+            log_config("No config data found, creating\n");
+            return save_config();
+        } 
+
+        ConfigData data;
+        util::json_path_reader reader;
+
+        reader.on_value = [&data](const auto &path, util::json_scalar &&value) {
+            if (path.size() == 1)
+                data.set_field(path[0].key, value);
+        };
+
+        if (!reader.parse(content)) return log_config(fmt::format("Invalid config json data, {}\n", reader.error));
+
+        *this = data;
+
+        log_config("Loaded config data json\n");
+
+        return 0;
+    }
+    
+    void set_field(const std::string &key, const util::json_scalar &value) {
+        if (key == "token_file") util::scalar_to(value, token_file);
+        else if (key == "token") util::scalar_to(value, token);
+        else if (key == "config_data_file") util::scalar_to(value, config_data_file);
+        else if (key == "bot_data_file") util::scalar_to(value, bot_data_file);
+        else if (key == "bot_snapshot_file") util::scalar_to(value, bot_snapshot_file);
+        else if (key == "pool_size") util::scalar_to(value, pool_size);
+        else if (key == "journal_flush_ms") util::scalar_to(value, journal_flush_ms);
+        else if (key == "journal_compact_bytes") util::scalar_to(value, journal_compact_bytes);
+        else if (key == "cache_ttl") util::scalar_to(value, cache_ttl);
+        else if (key == "cache_max_entries") util::scalar_to(value, cache_max_entries);
+        else if (key == "cache_max_bytes") util::scalar_to(value, cache_max_bytes);
+        else if (key == "cache_sweep_interval") util::scalar_to(value, cache_sweep_interval);
+        else if (key == "welcome_window") util::scalar_to(value, welcome_window);
+        else if (key == "metrics_file") util::scalar_to(value, metrics_file);
+        else if (key == "metrics_interval") util::scalar_to(value, metrics_interval);
+        else if (key == "shard_count") util::scalar_to(value, shard_count);
+        else if (key == "cluster_id") util::scalar_to(value, cluster_id);
+        else if (key == "cluster_count") util::scalar_to(value, cluster_count);
+        else if (key == "cache_dpp_objects") util::scalar_to(value, cache_dpp_objects);
+    }
+
+    int save_config() {
+        if (!config_data_file.size()) return log_config("No path for config data\n");
+
+        std::ofstream file(config_data_file);
+
+        if (!file.is_open()) return log_config("Could not open config data path for saving\n");
+
+        nlohmann::json j = *this;
+
+        file << j;
+
+        log_config("Saved config data json\n");
+
+        return 0;
+    }
+
+    int load_token() {
+        if (token.size()) return 0;
+        if (!token_file.size()) return log_config("No TOKEN file and supplied token in config is undefined\n");
+        std::ifstream file(token_file);
+        if (!file.is_open()) return log_config(fmt::format("Could not open token_file ({})\n", token_file));
+        std::getline(file, token, '\n');
+        if (!token.size()) return log_config("token length in TOKEN file is 0\n");
+        return 0;
+    }
+
+    ConfigData()
+        :token_file("TOKEN"),
+         token(),
+         config_data_file("config.json"),
+         bot_data_file("data.json"),
+         bot_snapshot_file("data.bin"),
+         pool_size(0),
+         journal_flush_ms(1000),
+         journal_compact_bytes(4 << 20),
+         cache_ttl(86400),
+         cache_max_entries(0),
+         cache_max_bytes(0),
+         cache_sweep_interval(300),
+         welcome_window(2),
+         metrics_file("metrics.prom"),
+         metrics_interval(15),
+         shard_count(0),
+         cluster_id(0),
+         cluster_count(1),
+         cache_dpp_objects(false) { }
+
+    protected:
+
+    int log_config(const std::string &str) {
+        return util::log_write(util::ll_info, {}, str);
+    }
+};
+
+/*
+ * Append only log of config mutations next to the bot data snapshot.
+ * Records are buffered and written + fsynced in batches by a worker thread,
+ * once the journal grows past compact_bytes the worker writes a fresh
+ * snapshot (tmp file + rename) and starts an empty journal.
+ *
+ * Callers must apply a mutation to the state before appending its record,
+ * replay is idempotent so a record landing in both snapshot and journal is fine.
+ */
+struct BotJournal {
+    std::string path;
+    std::string snapshot_path;
+    std::function<std::string()> snapshot;
+
+    std::chrono::milliseconds flush_interval{1000};
+    size_t compact_bytes = 4 << 20;
+
+    int open(const std::string &journal_path, const std::string &data_path, std::function<std::string()> snapshot_fn) {
+        path = journal_path;
+        snapshot_path = data_path;
+        snapshot = std::move(snapshot_fn);
+
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) return log_journal(fmt::format("Could not open journal {}: {}\n", path, strerror(errno)));
+
+        written = lseek(fd, 0, SEEK_END);
+        stopping = false;
+        worker = std::thread(&BotJournal::run, this);
+        return 0;
+    }
+
+    void append(const nlohmann::json &record) {
+        std::unique_lock<std::mutex> lock(m);
+        if (fd < 0) return;
+        buffer += record.dump();
+        buffer += '\n';
+    }
+
+    // Writes out buffered records and fsyncs, the cost is the size of the batch
+    int flush() {
+        std::string out;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            out.swap(buffer);
+        }
+        std::unique_lock<std::mutex> lock(io);
+        return write_out(out);
+    }
+
+    void request_compact() {
+        std::unique_lock<std::mutex> lock(m);
+        compact_requested = true;
+        cv.notify_all();
+    }
+
+    int compact() {
+        if (!snapshot) return -1;
+
+        std::string compacting = path + ".compacting";
+        {
+            std::unique_lock<std::mutex> lock(io);
+            std::string out;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                out.swap(buffer);
+            }
+            write_out(out);
+
+            // Records from here on land in the new journal, everything before is covered by the snapshot
+            ::close(fd);
+            if (access(compacting.c_str(), F_OK) == 0) {
+                // A failed compaction left records that are in no snapshot, keep them and add ours after
+                if (append_file(path, compacting)) {
+                    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                    return -1;
+                }
+            } else if (rename(path.c_str(), compacting.c_str())) {
+                // The journal is still the only copy of its records, keep appending to it
+                log_journal(fmt::format("Could not rotate journal {}: {}\n", path, strerror(errno)));
+                fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                return -1;
+            }
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            written = 0;
+        }
+
+        if (write_atomic(snapshot_path, snapshot())) return -1;
+
+        unlink(compacting.c_str());
+        log_journal("Compacted bot data journal\n", util::ll_info);
+        return 0;
+    }
+
+    // Without compacting the buffered records are flushed and the journal stays as it is
+    void close(bool compact_now = true) {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if (!worker.joinable()) return;
+            stopping = true;
+            cv.notify_all();
+        }
+        worker.join();
+        if (compact_now)
+            compact();
+        else
+            flush();
+        ::close(fd);
+        fd = -1;
+    }
+
+    // Calls fn for every complete record, a torn last line from a crash is skipped
+    template<typename F>
+    static size_t replay(const std::string &journal_path, F &&fn) {
+        std::ifstream file(journal_path);
+        if (!file.is_open()) return 0;
+
+        size_t count = 0;
+        std::string line;
+        while (std::getline(file, line)) {
+            auto record = nlohmann::json::parse(line, nullptr, false);
+            if (record.is_discarded()) continue;
+            fn(record);
+            count++;
+        }
+        return count;
+    }
+
+    static int append_file(const std::string &from, const std::string &to) {
+        std::string data;
+        if (util::read_file(from, data)) return log_journal(fmt::format("Could not read {}\n", from));
+        if (data.empty()) return 0;
+
+        int out = ::open(to.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (out < 0) return log_journal(fmt::format("Could not open {}: {}\n", to, strerror(errno)));
+        if (write_all(out, data) || fdatasync(out)) {
+            ::close(out);
+            return log_journal(fmt::format("Could not append to {}: {}\n", to, strerror(errno)));
+        }
+        ::close(out);
+        return 0;
+    }
+
+    static int write_atomic(const std::string &file_path, const std::string &data) {
+        std::string tmp = file_path + ".tmp";
+
+        int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) return log_journal(fmt::format("Could not open {}: {}\n", tmp, strerror(errno)));
+
+        if (write_all(out, data) || fsync(out)) {
+            ::close(out);
+            return log_journal(fmt::format("Could not write {}: {}\n", tmp, strerror(errno)));
+        }
+        ::close(out);
+
+        if (rename(tmp.c_str(), file_path.c_str()))
+            return log_journal(fmt::format("Could not rename {}: {}\n", tmp, strerror(errno)));
+
+        auto dir = std::filesystem::path(file_path).parent_path();
+        int dirfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd >= 0) {
+            fsync(dirfd);
+            ::close(dirfd);
+        }
+        return 0;
+    }
+
+    ~BotJournal() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                stopping = true;
+                cv.notify_all();
+            }
+            worker.join();
+        }
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    protected:
+
+    int fd = -1;
+    std::atomic<size_t> written = 0;
+
+    std::mutex m;
+    std::mutex io;
+    std::condition_variable cv;
+    std::string buffer;
+    std::thread worker;
+    bool stopping = false;
+    bool compact_requested = false;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+        while (!stopping) {
+            cv.wait_for(lock, flush_interval, [this]() { return stopping || compact_requested; });
+            bool compact_now = compact_requested;
+            compact_requested = false;
+            lock.unlock();
+
+            flush();
+            if (compact_now || written >= compact_bytes)
+                compact();
+
+            lock.lock();
+        }
+    }
+
+    int write_out(const std::string &out) {
+        if (out.empty() || fd < 0) return 0;
+        if (write_all(fd, out) || fdatasync(fd))
+            return log_journal(fmt::format("Could not write journal {}: {}\n", path, strerror(errno)));
+        written += out.size();
+        return 0;
+    }
+
+    static int write_all(int out, const std::string &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(out, data.data() + done, data.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += n;
+        }
+        return 0;
+    }
+
+    static int log_journal(const std::string &str, util::log_level level = util::ll_error) {
+        util::log_write(level, { .handler = "journal" }, str);
+        return -1;
+    }
+};
+
+/*
+ * Versioned binary snapshot of the guild table, mapped read only at startup.
+ *
+ *   header | index (sorted by guild id) | CBOR encoded GuildData blobs | CBOR global caches
+ *
+ * Only the header and index are touched when opening, a guild is decoded the
+ * first time it is looked up. The global user and channel caches are one blob
+ * decoded at startup.
+ */
+struct BotSnapshot {
+    static constexpr char magic[8] = { 'V', 'V', 'C', 'B', 'O', 'T', 'S', 0 };
+    static constexpr uint32_t version = 3;
+
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t guild_count;
+        uint64_t index_offset;
+        uint64_t blob_offset;
+        uint64_t blob_size;
+        uint64_t cache_offset;
+        uint64_t cache_size;
+        uint64_t cache_checksum;
+        // Of the index only, blobs carry their own so open() never reads them
+        uint64_t checksum;
+    };
+
+    struct entry {
+        uint64_t id;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t checksum;
+    };
+
+    BotSnapshot() { }
+    BotSnapshot(const BotSnapshot &) = delete;
+    BotSnapshot &operator=(const BotSnapshot &) = delete;
+
+    ~BotSnapshot() {
+        close();
+    }
+
+    int open(const std::string &path) {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+
+        struct stat st;
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(header)) {
+            ::close(fd);
+            return log_snapshot(fmt::format("Snapshot {} is truncated\n", path));
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return log_snapshot(fmt::format("Could not map {}: {}\n", path, strerror(errno)));
+
+        data = static_cast<const uint8_t*>(p);
+        length = st.st_size;
+
+        if (const char *error = validate()) {
+            close();
+            return log_snapshot(fmt::format("Invalid snapshot {}: {}\n", path, error));
+        }
+
+        auto *h = reinterpret_cast<const header*>(data);
+        entries = reinterpret_cast<const entry*>(data + h->index_offset);
+        count = h->guild_count;
+        blobs = data + h->blob_offset;
+        cache_blob = data + h->cache_offset;
+        cache_size = h->cache_size;
+        cache_checksum = h->cache_checksum;
+        return 0;
+    }
+
+    void close() {
+        if (data) munmap(const_cast<uint8_t*>(data), length);
+        data = nullptr;
+        entries = nullptr;
+        blobs = nullptr;
+        cache_blob = nullptr;
+        length = count = cache_size = 0;
+        cache_checksum = 0;
+    }
+
+    bool is_open() const { return data != nullptr; }
+    size_t size() const { return count; }
+
+    const entry *begin() const { return entries; }
+    const entry *end() const { return entries + count; }
+
+    const entry *find(uint64_t id) const {
+        auto *iter = std::lower_bound(begin(), end(), id, [](const entry &e, uint64_t id) { return e.id < id; });
+        if (iter == end() || iter->id != id) return nullptr;
+        return iter;
+    }
+
+    // Checked on every call, a corrupt blob comes back empty
+    std::pair<const uint8_t*, const uint8_t*> blob(const entry *e) const {
+        if (checksum(blobs + e->offset, e->size) != e->checksum) {
+            log_snapshot(fmt::format("Checksum mismatch for guild {}\n", e->id));
+            return { nullptr, nullptr };
+        }
+        return { blobs + e->offset, blobs + e->offset + e->size };
+    }
+
+    std::pair<const uint8_t*, const uint8_t*> cache() const {
+        if (checksum(cache_blob, cache_size) != cache_checksum) {
+            log_snapshot("Checksum mismatch for the cache section\n");
+            return { nullptr, nullptr };
+        }
+        return { cache_blob, cache_blob + cache_size };
+    }
+
+    // entries are (guild id, CBOR blob), sorted here
+    static std::string encode(std::vector<std::pair<uint64_t, std::string>> &guilds, const std::string &cache = "") {
+        std::sort(guilds.begin(), guilds.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        header h{};
+        memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.guild_count = guilds.size();
+        h.index_offset = sizeof(header);
+        h.blob_offset = h.index_offset + guilds.size() * sizeof(entry);
+
+        std::string out(h.blob_offset, '\0');
+        uint64_t offset = 0;
+        for (size_t i = 0; i < guilds.size(); i++) {
+            auto &blob = guilds[i].second;
+            entry e{ guilds[i].first, offset, (uint32_t)blob.size(), 0, checksum(reinterpret_cast<const uint8_t*>(blob.data()), blob.size()) };
+            memcpy(out.data() + h.index_offset + i * sizeof(entry), &e, sizeof(e));
+            offset += e.size;
+        }
+        h.blob_size = offset;
+        h.cache_offset = h.blob_offset + h.blob_size;
+        h.cache_size = cache.size();
+        h.cache_checksum = checksum(reinterpret_cast<const uint8_t*>(cache.data()), cache.size());
+
+        out.reserve(out.size() + offset + cache.size());
+        for (auto &[id, blob] : guilds)
+            out += blob;
+        out += cache;
+
+        h.checksum = checksum(reinterpret_cast<const uint8_t*>(out.data()) + h.index_offset, h.blob_offset - h.index_offset);
+        memcpy(out.data(), &h, sizeof(h));
+        return out;
+    }
+
+    static uint64_t checksum(const uint8_t *p, size_t n) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < n; i++) {
+            hash ^= p[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    protected:
+
+    const uint8_t *data = nullptr;
+    size_t length = 0;
+    const entry *entries = nullptr;
+    const uint8_t *blobs = nullptr;
+    const uint8_t *cache_blob = nullptr;
+    size_t count = 0;
+    size_t cache_size = 0;
+    uint64_t cache_checksum = 0;
+
+    const char *validate() const {
+        auto *h = reinterpret_cast<const header*>(data);
+        if (memcmp(h->magic, magic, sizeof(magic))) return "bad magic";
+        if (h->version != version) return "unsupported version";
+        if (h->index_offset != sizeof(header)) return "bad index offset";
+        if (h->blob_offset != h->index_offset + (uint64_t)h->guild_count * sizeof(entry)) return "bad blob offset";
+        if (h->blob_offset > length || h->cache_offset != h->blob_offset + h->blob_size) return "bad cache offset";
+        if (h->cache_offset > length || h->cache_size != length - h->cache_offset) return "size mismatch";
+        if (h->checksum != checksum(data + h->index_offset, h->blob_offset - h->index_offset)) return "checksum mismatch";
+
+        auto *e = reinterpret_cast<const entry*>(data + h->index_offset);
+        for (uint32_t i = 0; i < h->guild_count; i++) {
+            if (e[i].offset + e[i].size > h->blob_size) return "entry out of range";
+            if (i && e[i - 1].id >= e[i].id) return "index not sorted";
+        }
+        return nullptr;
+    }
+
+    static int log_snapshot(const std::string &str) {
+        util::log_write(util::ll_error, { .handler = "snapshot" }, str);
+        return -1;
+    }
+};
+
+struct BotDataContainer {
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(BotDataContainer, guilds);
+
+    util::sharded_map<dpp::snowflake, UserData> users;
+    util::sharded_map<our_snowflake, GuildData> guilds;
+    util::sharded_map<dpp::snowflake, ChannelData> channels;
+
+    size_t user_bytes() const {
+        size_t sum = users.memory_usage();
+        users.for_each([&sum](auto &pair) { sum += pair.second.heap_bytes(); });
+        return sum;
+    }
+
+    size_t channel_bytes() const {
+        size_t sum = channels.memory_usage();
+        channels.for_each([&sum](auto &pair) { sum += pair.second.heap_bytes(); });
+        return sum;
+    }
+
+    size_t guild_bytes() const {
+        size_t sum = guilds.memory_usage();
+        guilds.for_each([&sum](auto &pair) { sum += pair.second.memory_usage().total() - sizeof(GuildData); });
+        return sum;
+    }
+
+    /*
+     * Streams the JSON bot data into data, guilds are stored as [id, {fields}]
+     * pairs so a guild is complete when its pair array closes
+     */
+    static int parse_json(const std::string &content, BotDataContainer &data, std::string &error) {
+        util::json_path_reader reader;
+        GuildData pending;
+        std::vector<AutoResponderData> responders;
+
+        reader.on_value = [&pending, &responders](const auto &path, util::json_scalar &&value) {
+            if (path.size() < 3 || path[0].key != "guilds") return;
+            if (path.size() == 3 && path[2].index == 0)
+                util::scalar_to(value, pending.id);
+            else if (path.size() == 4 && path[2].index == 1)
+                pending.set_field(path[3].key, value);
+            else if (path.size() == 6 && path[2].index == 1 && path[3].key == "responders") {
+                if (responders.size() <= path[4].index)
+                    responders.resize(path[4].index + 1);
+                responders[path[4].index].set_field(path[5].key, value);
+            }
+        };
+
+        reader.on_end = [&pending, &responders, &data](const auto &path) {
+            if (path.size() != 2 || path[0].key != "guilds") return;
+            pending.responders.set(std::move(responders));
+            if (pending.id)
+                data.guilds.emplace(pending.id, pending);
+            pending = GuildData();
+            responders.clear();
+        };
+
+        if (!reader.parse(content)) {
+            error = reader.error;
+            return -1;
+        }
+        return 0;
+    }
+};
+
+struct BotData : public ConfigData, public BotDataContainer {
+    dpp::cluster bot;
+
+    BotJournal journal;
+    BotSnapshot snapshot;
+
+    // Digest of the slash commands last registered with Discord
+    std::atomic<uint64_t> command_digest = 0;
+
+    /*
+     * Maps the binary snapshot when there is a valid one, otherwise imports the
+     * JSON bot data. The journal is replayed on top of either.
+     */
+    int load_data() {
+        if (!bot_snapshot_file.size()) return log_config("No path for bot snapshot\n");
+
+        std::string snapshot_file = partition_path(bot_snapshot_file);
+
+        if (!snapshot.open(snapshot_file)) {
+            log_config(fmt::format("Mapped bot snapshot, {} guilds\n", snapshot.size()));
+            restore_cache();
+        }
+        else if (bot_data_file.size())
+            load_json(bot_data_file);
+
+        std::string journal_file = snapshot_file + ".journal";
+        auto apply = [this](const nlohmann::json &record) { apply_record(record); };
+        size_t replayed = BotJournal::replay(journal_file + ".compacting", apply);
+        replayed += BotJournal::replay(journal_file, apply);
+
+        if (replayed)
+            log_config(fmt::format("Replayed {} journal records\n", replayed));
+
+        journal.flush_interval = std::chrono::milliseconds(journal_flush_ms);
+        journal.compact_bytes = journal_compact_bytes;
+
+        return journal.open(journal_file, snapshot_file, [this]() {
+            return encode_snapshot();
+        });
+    }
+
+    int load_json(const std::string &path) {
+        std::string content;
+
+        if (util::read_file(path, content)) return log_config("No bot data found, creating\n");
+
+        BotDataContainer data;
+        std::string error;
+
+        if (parse_json(content, data, error)) return log_config(fmt::format("Invalid bot data json data, {}\n", error));
+
+        // The JSON holds every guild, a cluster keeps the ones on its shards
+        if (is_partitioned()) {
+            std::vector<dpp::snowflake> others;
+            data.guilds.for_each([&](auto &pair) {
+                if (!owns_guild(pair.first)) others.push_back(pair.first);
+            });
+            for (auto id : others)
+                data.guilds.erase(id);
+        }
+
+        *(BotDataContainer*)this = std::move(data);
+
+        log_config("Loaded bot data json\n");
+
+        return 0;
+    }
+
+    int export_json(const std::string &path) {
+        for (auto &e : snapshot)
+            find_guild(e.id);
+
+        nlohmann::json j = *(BotDataContainer*)this;
+
+        if (BotJournal::write_atomic(path, j.dump(4))) return -1;
+
+        log_config(fmt::format("Exported bot data json to {}\n", path));
+        return 0;
+    }
+
+    // Joins the per-cluster exports into one file every cluster can import its guilds from
+    int merge_json(const std::string &path, const std::vector<std::string> &inputs) {
+        std::set<uint64_t> seen;
+        auto merged = nlohmann::json::array();
+
+        for (auto &input : inputs) {
+            std::string content;
+            if (util::read_file(input, content)) return log_config(fmt::format("Could not read {}\n", input));
+            auto j = nlohmann::json::parse(content, nullptr, false);
+            if (j.is_discarded()) return log_config(fmt::format("{} is not valid json\n", input));
+
+            for (auto &e : j.value("guilds", nlohmann::json::array()))
+                if (seen.insert((uint64_t)e.at(0).template get<our_snowflake>()).second)
+                    merged.push_back(e);
+        }
+
+        nlohmann::json out = { { "guilds", merged } };
+        if (BotJournal::write_atomic(path, out.dump(4))) return -1;
+
+        log_config(fmt::format("Merged {} guilds from {} files into {}\n", merged.size(), inputs.size(), path));
+        return 0;
+    }
+
+    // Replaces the snapshot with the JSON file, the journal is dropped since the file is authoritative
+    int import_json(const std::string &path) {
+        if (load_json(path)) return -1;
+
+        std::string snapshot_file = partition_path(bot_snapshot_file);
+        if (BotJournal::write_atomic(snapshot_file, encode_snapshot())) return -1;
+
+        unlink((snapshot_file + ".journal").c_str());
+        unlink((snapshot_file + ".journal.compacting").c_str());
+        log_config(fmt::format("Imported bot data json from {}\n", path));
+        return 0;
+    }
+
+    std::string encode_snapshot() {
+        std::vector<std::pair<uint64_t, std::string>> entries;
+
+        guilds.for_each([&entries](auto &pair) {
+            nlohmann::json j = pair.second;
+            j["cache"] = pair.second.cache_json();
+            if (auto job = pair.second.get_verify_job(); job.mode.size())
+                j["verify_job"] = job;
+            auto cbor = nlohmann::json::to_cbor(j);
+            entries.emplace_back((uint64_t)pair.first, std::string(cbor.begin(), cbor.end()));
+        });
+
+        // Guilds never looked up since startup are copied over still encoded
+        size_t materialized = entries.size();
+        for (auto &e : snapshot) {
+            if (guilds.contains(e.id)) continue;
+            auto [first, last] = snapshot.blob(&e);
+            if (first == last) continue;
+            entries.emplace_back(e.id, std::string(first, last));
+        }
+
+        log_config(fmt::format("Encoding snapshot, {} guilds ({} decoded)\n", entries.size(), materialized));
+
+        auto cache = nlohmann::json::to_cbor(cache_json());
+
+        return BotSnapshot::encode(entries, std::string(cache.begin(), cache.end()));
+    }
+
+    nlohmann::json cache_json() const {
+        auto users_json = nlohmann::json::array();
+        users.for_each([&users_json](auto &pair) {
+            users_json.push_back({ (uint64_t)pair.first, pair.second.cache_json() });
+        });
+
+        auto channels_json = nlohmann::json::array();
+        channels.for_each([&channels_json](auto &pair) {
+            channels_json.push_back({ (uint64_t)pair.first, pair.second.cache_json() });
+        });
+
+        return { { "users", users_json }, { "channels", channels_json }, { "command_digest", command_digest.load() } };
+    }
+
+    // Stale entries are still served, Program revalidates them in the background
+    void restore_cache() {
+        auto [first, last] = snapshot.cache();
+        if (first == last) return;
+
+        auto j = nlohmann::json::from_cbor(first, last, true, false);
+        if (j.is_discarded()) {
+            log_config("Corrupt cache section in snapshot\n");
+            return;
+        }
+
+        for (auto &e : j.value("users", nlohmann::json::array())) {
+            dpp::snowflake id = e.at(0).template get<uint64_t>();
+            users.emplace(id).first->second.restore(id, e.at(1));
+        }
+
+        for (auto &e : j.value("channels", nlohmann::json::array())) {
+            dpp::snowflake id = e.at(0).template get<uint64_t>();
+            channels.emplace(id).first->second.restore(id, e.at(1));
+        }
+
+        command_digest = j.value("command_digest", (uint64_t)0);
+
+        log_config(fmt::format("Restored {} users, {} channels from snapshot\n", users.size(), channels.size()));
+    }
+
+    bool is_fresh(uint64_t fetched_at) const {
+        return fetched_at + cache_ttl > util::unix_now();
+    }
+
+    void restore_guild_cache(GuildData *guild, const nlohmann::json &j) {
+        dpp::snowflake guild_id = guild->id;
+
+        for (auto &e : j.value("roles", nlohmann::json::array())) {
+            dpp::snowflake id = e.at(0).template get<uint64_t>();
+            auto &role = guild->roles.emplace(id).first->second;
+            role.guild = guild;
+            role.restore(id, guild_id, e.at(1));
+            guild->index_role(&role);
+        }
+
+        for (auto &e : j.value("users", nlohmann::json::array())) {
+            dpp::snowflake id = e.at(0).template get<uint64_t>();
+            auto *user = util::get_or_null(users, id);
+            if (!user) continue;
+            auto &member = guild->users.emplace(id).first->second;
+            member.user = user;
+            member.guild = guild;
+            member.restore(id, guild_id, e.at(1));
+        }
+
+        for (auto &e : j.value("channels", nlohmann::json::array())) {
+            dpp::snowflake id = e.at(0).template get<uint64_t>();
+            auto *channel = util::get_or_null(channels, id);
+            if (!channel) continue;
+            auto &data = guild->channels.emplace(id, guild, channel).first->second;
+            data.id = id;
+            data.name = channel->name;
+            data.bot_allowed = e.at(1).value("bot_allowed", true);
+        }
+
+        guild->members_fetched_at = j.value("members_fetched_at", (uint64_t)0);
+        guild->roles_fetched_at = j.value("roles_fetched_at", (uint64_t)0);
+        guild->members_synced = is_fresh(guild->members_fetched_at);
+        guild->roles_synced = is_fresh(guild->roles_fetched_at);
+    }
+
+    UserData *find_user(const dpp::snowflake user_id) {
+        return users.get(user_id, [](auto &user) { user.touch(); });
+    }
+
+    GuildData *find_guild(const dpp::snowflake guild_id) {
+        if (auto *cached = util::get_or_null(guilds, guild_id))
+            return cached;
+
+        auto *e = snapshot.find(guild_id);
+        if (!e) return nullptr;
+
+        auto [first, last] = snapshot.blob(e);
+        auto j = nlohmann::json::from_cbor(first, last, true, false);
+        if (j.is_discarded()) {
+            log_config(fmt::format("Corrupt snapshot entry for guild {}\n", (uint64_t)guild_id));
+            return nullptr;
+        }
+
+        auto [entry, inserted] = guilds.emplace(guild_id, j.template get<GuildData>());
+        if (inserted && j.contains("cache"))
+            restore_guild_cache(&entry->second, j["cache"]);
+        if (inserted && j.contains("verify_job"))
+            entry->second.set_verify_job(j["verify_job"].template get<VerifyJobData>());
+
+        return &entry->second;
+    }
+
+    // Writes a full snapshot and truncates the journal, only needed at shutdown
+    int save_data() {
+        if (!bot_snapshot_file.size()) return log_config("No path for bot snapshot\n");
+
+        journal.close();
+
+        log_config("Saved bot snapshot\n");
+
+        return 0;
+    }
+
+    void record_guild(const GuildData *guild) {
+        journal.append({ { "guild", *guild } });
+    }
+
+    void record_command_digest(uint64_t digest) {
+        command_digest = digest;
+        journal.append({ { "command_digest", digest } });
+    }
+
+    void record_verify_job(GuildData *guild, const VerifyJobData &job) {
+        guild->set_verify_job(job);
+        journal.append({ { "verify_job", { { "guild", (uint64_t)guild->id }, { "job", job } } } });
+    }
+
+    void apply_record(const nlohmann::json &record) {
+        if (record.contains("command_digest"))
+            command_digest = record["command_digest"].template get<uint64_t>();
+
+        if (record.contains("verify_job")) {
+            auto &r = record["verify_job"];
+            if (auto *guild = find_guild(r["guild"].template get<uint64_t>()))
+                guild->set_verify_job(r["job"].template get<VerifyJobData>());
+        }
+
+        if (!record.contains("guild")) return;
+
+        auto data = record["guild"].template get<GuildData>();
+        if (!data.id) return;
+
+        if (auto *guild = find_guild(data.id))
+            guild->copy_config(data);
+        else
+            guilds.emplace(data.id, data);
+    }
+};
+
+enum rest_priority {
+    rp_interaction,
+    rp_verify,
+    rp_welcome,
+    rp_cache,
+    rp_count
+};
+
+/*
+ * Every outbound REST call is queued here by priority and handed to DPP only
+ * when fewer than max_inflight calls are outstanding and the route's bucket
+ * has budget left. DPP's own queue is FIFO, keeping it short is what lets an
+ * interaction reply overtake a backlog of cache fills. Full queues reject new
+ * work instead of growing, the caller sees a failed confirmation.
+ */
+struct RestScheduler {
+    using clock = std::chrono::steady_clock;
+    using done_type = std::function<void(const dpp::confirmation_callback_t&)>;
+    using start_type = std::function<void(done_type)>;
+
+    struct request {
+        std::string route;
+        start_type start;
+        done_type done;
+        clock::time_point queued;
+    };
+
+    // Budget from the last X-RateLimit headers seen on a route
+    struct bucket {
+        bool known = false;
+        uint64_t remaining = 0;
+        uint32_t inflight = 0;
+        clock::time_point reset;
+    };
+
+    struct class_stats {
+        std::atomic<uint64_t> submitted = 0;
+        std::atomic<uint64_t> rejected = 0;
+        std::atomic<uint64_t> completed = 0;
+        std::atomic<uint64_t> wait_ns = 0;
+        std::atomic<uint64_t> max_wait_ns = 0;
+        std::atomic<size_t> depth = 0;
+    };
+
+    static constexpr std::array<const char*, rp_count> class_names = { "interaction", "verify", "welcome", "cache" };
+
+    uint32_t max_inflight = 8;
+    std::array<size_t, rp_count> queue_limit = { 4096, 4096, 1024, 16384 };
+
+    std::array<class_stats, rp_count> stats;
+
+    void start() {
+        std::unique_lock<std::mutex> lock(m);
+        if (worker.joinable()) return;
+        stopping = false;
+        worker = std::thread(&RestScheduler::run, this);
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if (!worker.joinable()) return;
+            stopping = true;
+            cv.notify_all();
+        }
+        worker.join();
+    }
+
+    bool submit(rest_priority priority, std::string route, start_type start, done_type done) {
+        auto &s = stats[priority];
+        s.submitted++;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            if (queues[priority].size() < queue_limit[priority]) {
+                queues[priority].push_back({ std::move(route), std::move(start), std::move(done), clock::now() });
+                s.depth = queues[priority].size();
+                cv.notify_all();
+                return true;
+            }
+        }
+        s.rejected++;
+        done(rejected());
+        return false;
+    }
+
+    static dpp::confirmation_callback_t rejected() {
+        dpp::http_request_completion_t http;
+        http.status = 429;
+        http.body = R"({"message": "Local REST queue full", "code": 0})";
+        return dpp::confirmation_callback_t(http);
+    }
+
+    uint32_t inflight_count() {
+        std::unique_lock<std::mutex> lock(m);
+        return inflight;
+    }
+
+    void log_stats() {
+        for (size_t i = 0; i < rp_count; i++) {
+            auto &s = stats[i];
+            uint64_t completed = s.completed;
+            log("REST %-12s %lu queued, %lu submitted, %lu rejected, %.1f ms mean wait, %.1f ms max wait\n", class_names[i],
+                s.depth.load(), s.submitted.load(), s.rejected.load(),
+                completed ? s.wait_ns / 1e6 / completed : 0.0, s.max_wait_ns / 1e6);
+        }
+    }
+
+    private:
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread worker;
+    bool stopping = false;
+
+    std::array<std::deque<request>, rp_count> queues;
+    std::map<std::string, bucket, std::less<>> buckets;
+    uint32_t inflight = 0;
+    uint64_t completions = 0;
+
+    // Routes carry guild and channel ids, idle buckets are dropped every this many completions
+    static constexpr uint64_t prune_every = 1024;
+
+    // Only this many entries of a class are scanned past a blocked route
+    static constexpr size_t scan_limit = 32;
+
+    bool available(const bucket &b, clock::time_point now) const {
+        if (!b.known) return b.inflight == 0;
+        return b.remaining > b.inflight || now >= b.reset;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+
+        while (!stopping) {
+            auto now = clock::now();
+            auto wake = clock::time_point::max();
+            bool dispatched = false;
+
+            for (size_t p = 0; p < rp_count && inflight < max_inflight && !dispatched; p++) {
+                auto &queue = queues[p];
+                size_t scan = std::min(queue.size(), scan_limit);
+
+                for (size_t i = 0; i < scan; i++) {
+                    auto &b = buckets[queue[i].route];
+                    if (!available(b, now)) {
+                        if (b.known) wake = std::min(wake, b.reset);
+                        continue;
+                    }
+
+                    request r = std::move(queue[i]);
+                    queue.erase(queue.begin() + i);
+                    stats[p].depth = queue.size();
+
+                    if (b.known && now >= b.reset)
+                        b.remaining = std::max<uint64_t>(b.remaining, 1);
+                    b.inflight++;
+                    inflight++;
+
+                    dispatch(std::move(r), (rest_priority)p, now, lock);
+                    dispatched = true;
+                    break;
+                }
+            }
+
+            if (dispatched) continue;
+
+            if (wake == clock::time_point::max())
+                cv.wait(lock);
+            else
+                cv.wait_until(lock, wake);
+        }
+    }
+
+    void dispatch(request r, rest_priority priority, clock::time_point now, std::unique_lock<std::mutex> &lock) {
+        auto &s = stats[priority];
+        uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(now - r.queued).count();
+        s.wait_ns += wait;
+        if (wait > s.max_wait_ns) s.max_wait_ns = wait;
+
+        auto route = r.route;
+        auto done = std::move(r.done);
+
+        lock.unlock();
+        r.start([this, route, done, priority](const dpp::confirmation_callback_t &cc) {
+            complete(route, cc.http_info);
+            stats[priority].completed++;
+            done(cc);
+        });
+        lock.lock();
+    }
+
+    void complete(const std::string &route, const dpp::http_request_completion_t &http) {
+        std::unique_lock<std::mutex> lock(m);
+        auto &b = buckets[route];
+        auto now = clock::now();
+
+        if (b.inflight) b.inflight--;
+        if (inflight) inflight--;
+
+        if (http.status == 429) {
+            b.known = true;
+            b.remaining = 0;
+            b.reset = now + std::chrono::milliseconds((uint64_t)(http.ratelimit_retry_after * 1000));
+        } else if (http.ratelimit_limit) {
+            b.known = true;
+            b.remaining = http.ratelimit_remaining;
+            b.reset = now + std::chrono::milliseconds((uint64_t)(http.ratelimit_reset_after * 1000));
+        } else {
+            // No rate limit headers, the route is not limited per bucket
+            b.known = true;
+            b.remaining = UINT64_MAX;
+        }
+
+        if (++completions % prune_every == 0)
+            prune(now);
+
+        cv.notify_all();
+    }
+
+    // A bucket with nothing in flight and its window over holds nothing a fresh one wouldn't
+    void prune(clock::time_point now) {
+        std::erase_if(buckets, [now](auto &pair) {
+            return pair.second.inflight == 0 && now >= pair.second.reset;
+        });
+    }
+};
+
+/*
+ * Runs work keyed by guild on pool_size threads. Work for one guild starts in
+ * the order it was posted and never on two threads at once, different guilds
+ * run in parallel. A coroutine handler suspended in a co_await is resumed by
+ * posting to its guild again, so all of it runs on the strand, but the guild's
+ * later events may run while it waits. Each guild has a strand of pending
+ * work, a strand with work sits in exactly one worker deque: its home worker's
+ * when it becomes runnable, or the deque of the worker that last ran it. Idle
+ * workers steal strands from the back of other deques.
+ */
+struct GuildExecutor {
+    using task_type = std::function<void()>;
+
+    struct worker_stats {
+        // Tasks posted to guilds homed on this worker and not run yet
+        std::atomic<size_t> depth = 0;
+        std::atomic<uint64_t> executed = 0;
+        std::atomic<uint64_t> stolen = 0;
+    };
+
+    // A strand runs this many tasks before going to the back of the deque, so a busy guild can't starve others
+    static constexpr size_t batch = 16;
+    // Idle strands are dropped every this many posts
+    static constexpr uint64_t prune_every = 1024;
+
+    void start(size_t count) {
+        std::unique_lock<std::mutex> lock(wake_lock);
+        if (workers.size()) return;
+
+        stopping = false;
+        count = std::max<size_t>(count ? count : std::thread::hardware_concurrency(), 1);
+        workers.resize(count);
+        for (auto &w : workers)
+            w = std::make_unique<worker>();
+        for (size_t i = 0; i < count; i++)
+            workers[i]->thread = std::thread(&GuildExecutor::run, this, i);
+    }
+
+    // Runs everything already posted, then joins the workers
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(wake_lock);
+            if (workers.empty() || stopping) return;
+            stopping = true;
+            wake.notify_all();
+        }
+        for (auto &w : workers)
+            w->thread.join();
+    }
+
+    // Without workers the task runs inline, the way events were handled before
+    void post(dpp::snowflake guild_id, task_type task) {
+        {
+            // Workers don't exit while a post is between this check and its push
+            std::unique_lock<std::mutex> lock(wake_lock);
+            if (workers.empty() || stopping) {
+                lock.unlock();
+                task();
+                return;
+            }
+            posting++;
+        }
+
+        strand *s;
+        size_t home;
+        bool schedule;
+        {
+            // A scheduled strand is never pruned, once it is pushed s stays valid
+            std::unique_lock<std::mutex> lock(strands_lock);
+            s = get_strand(guild_id);
+            home = s->home;
+            std::unique_lock<std::mutex> strand_lock(s->m);
+            s->tasks.push_back(std::move(task));
+            schedule = !s->scheduled;
+            s->scheduled = true;
+            strand_lock.unlock();
+            if (++posts % prune_every == 0)
+                prune();
+        }
+        workers[home]->stats.depth++;
+
+        if (schedule) {
+            std::unique_lock<std::mutex> lock(workers[home]->m);
+            workers[home]->queue.push_back(s);
+        }
+
+        std::unique_lock<std::mutex> lock(wake_lock);
+        posting--;
+        if (schedule) {
+            runnable++;
+            wake.notify_one();
+        }
+        if (stopping && !posting)
+            wake.notify_all();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    const worker_stats &stats(size_t i) const { return workers[i]->stats; }
+
+    void log_stats() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            auto &s = workers[i]->stats;
+            log("Executor worker %-3lu %lu queued, %lu executed, %lu stolen\n", i, s.depth.load(), s.executed.load(), s.stolen.load());
+        }
+    }
+
+    ~GuildExecutor() {
+        stop();
+    }
+
+    private:
+
+    struct strand {
+        std::mutex m;
+        std::deque<task_type> tasks;
+        bool scheduled = false;
+        size_t home = 0;
+        // Posts a suspended coroutine back to this strand
+        util::resumer resume;
+    };
+
+    struct worker {
+        std::mutex m;
+        std::deque<strand*> queue;
+        std::thread thread;
+        worker_stats stats;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+
+    // One per guild with work queued or posted since the last prune
+    std::mutex strands_lock;
+    std::unordered_map<uint64_t, std::unique_ptr<strand>> strands;
+    uint64_t posts = 0;
+
+    // Strands sitting in some deque, workers sleep while it is 0
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    size_t runnable = 0;
+    size_t posting = 0;
+    bool stopping = false;
+
+    // With strands_lock held
+    strand *get_strand(dpp::snowflake guild_id) {
+        auto &s = strands[guild_id];
+        if (!s) {
+            s = std::make_unique<strand>();
+            s->home = util::hash_snowflake(guild_id) % workers.size();
+            s->resume = [this, guild_id](std::coroutine_handle<> h) { post(guild_id, [h]() { h.resume(); }); };
+        }
+        return s.get();
+    }
+
+    // With strands_lock held, a strand that is not scheduled is in no deque and no worker holds it
+    void prune() {
+        std::erase_if(strands, [](auto &pair) {
+            std::unique_lock<std::mutex> lock(pair.second->m);
+            return !pair.second->scheduled;
+        });
+    }
+
+    void push(size_t i, strand *s) {
+        {
+            std::unique_lock<std::mutex> lock(workers[i]->m);
+            workers[i]->queue.push_back(s);
+        }
+        std::unique_lock<std::mutex> lock(wake_lock);
+        runnable++;
+        wake.notify_one();
+    }
+
+    strand *take(size_t i) {
+        {
+            auto &own = *workers[i];
+            std::unique_lock<std::mutex> lock(own.m);
+            if (own.queue.size()) {
+                auto *s = own.queue.front();
+                own.queue.pop_front();
+                return s;
+            }
+        }
+
+        for (size_t k = 1; k < workers.size(); k++) {
+            auto &other = *workers[(i + k) % workers.size()];
+            std::unique_lock<std::mutex> lock(other.m);
+            if (other.queue.size()) {
+                auto *s = other.queue.back();
+                other.queue.pop_back();
+                workers[i]->stats.stolen++;
+                return s;
+            }
+        }
+        return nullptr;
+    }
+
+    void run(size_t i) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(wake_lock);
+                wake.wait(lock, [this]() { return runnable || (stopping && !posting); });
+                if (!runnable) return;
+                runnable--;
+            }
+
+            // runnable counted a strand in some deque, it is there unless another worker beat us to it
+            strand *s = take(i);
+            if (!s) {
+                std::unique_lock<std::mutex> lock(wake_lock);
+                runnable++;
+                continue;
+            }
+
+            execute(i, s);
+        }
+    }
+
+    void execute(size_t i, strand *s) {
+        for (size_t n = 0; n < batch; n++) {
+            task_type task;
+            {
+                std::unique_lock<std::mutex> lock(s->m);
+                if (s->tasks.empty()) {
+                    s->scheduled = false;
+                    return;
+                }
+                task = std::move(s->tasks.front());
+                s->tasks.pop_front();
+            }
+
+            workers[s->home]->stats.depth--;
+            util::resume_on = s->resume;
+            task();
+            util::resume_on = nullptr;
+            workers[i]->stats.executed++;
+        }
+
+        std::unique_lock<std::mutex> lock(s->m);
+        if (s->tasks.empty()) {
+            s->scheduled = false;
+            return;
+        }
+        lock.unlock();
+        push(i, s);
+    }
+};
+
+/*
+ * Handler latency histograms, cache counters and gauges. Everything is
+ * registered up front and then only touched through atomics, so recording
+ * is lock free. Rendered as Prometheus text and as a short summary.
+ */
+struct BotMetrics {
+    using clock = std::chrono::steady_clock;
+
+    static constexpr std::array<double, 14> bounds = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+    struct histogram {
+        std::array<std::atomic<uint64_t>, bounds.size() + 1> buckets {};
+        std::atomic<uint64_t> count = 0;
+        std::atomic<uint64_t> sum_ns = 0;
+
+        void observe(clock::duration d) {
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+            double seconds = ns / 1e9;
+            size_t i = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+            buckets[i]++;
+            count++;
+            sum_ns += ns;
+        }
+
+        // Upper bound of the bucket holding quantile q
+        double quantile(double q) const {
+            uint64_t total = count, seen = 0;
+            if (!total) return 0;
+            for (size_t i = 0; i < bounds.size(); i++) {
+                seen += buckets[i];
+                if (seen >= q * total) return bounds[i];
+            }
+            return std::numeric_limits<double>::infinity();
+        }
+    };
+
+    // Records the time until it goes out of scope, in a coroutine that includes every co_await
+    struct timer {
+        histogram *h;
+        clock::time_point start = clock::now();
+
+        ~timer() {
+            if (h) h->observe(clock::now() - start);
+        }
+    };
+
+    struct cache_counters {
+        std::atomic<uint64_t> hit = 0;
+        std::atomic<uint64_t> miss = 0;
+        std::atomic<uint64_t> fill = 0;
+        std::atomic<uint64_t> evict = 0;
+    };
+
+    histogram &handler(const std::string &name) {
+        std::unique_lock<std::mutex> lock(m);
+        return handlers.try_emplace(name).first->second;
+    }
+
+    cache_counters &cache(const std::string &name) {
+        std::unique_lock<std::mutex> lock(m);
+        return caches.try_emplace(name).first->second;
+    }
+
+    void gauge(const std::string &name, std::function<double()> fn) {
+        std::unique_lock<std::mutex> lock(m);
+        gauges.emplace_back(name, std::move(fn));
+    }
+
+    std::string prometheus() {
+        std::unique_lock<std::mutex> lock(m);
+        std::string out;
+
+        out += "# TYPE discord_bot_handler_seconds histogram\n";
+        for (auto &[name, h] : handlers) {
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < bounds.size(); i++) {
+                cumulative += h.buckets[i];
+                out += fmt::format("discord_bot_handler_seconds_bucket{{handler=\"{}\",le=\"{}\"}} {}\n", name, bounds[i], cumulative);
+            }
+            out += fmt::format("discord_bot_handler_seconds_bucket{{handler=\"{}\",le=\"+Inf\"}} {}\n", name, h.count.load());
+            out += fmt::format("discord_bot_handler_seconds_sum{{handler=\"{}\"}} {}\n", name, h.sum_ns / 1e9);
+            out += fmt::format("discord_bot_handler_seconds_count{{handler=\"{}\"}} {}\n", name, h.count.load());
+        }
+
+        out += "# TYPE discord_bot_cache_requests_total counter\n";
+        for (auto &[name, c] : caches) {
+            out += fmt::format("discord_bot_cache_requests_total{{cache=\"{}\",result=\"hit\"}} {}\n", name, c.hit.load());
+            out += fmt::format("discord_bot_cache_requests_total{{cache=\"{}\",result=\"miss\"}} {}\n", name, c.miss.load());
+            out += fmt::format("discord_bot_cache_requests_total{{cache=\"{}\",result=\"fill\"}} {}\n", name, c.fill.load());
+        }
+
+        out += "# TYPE discord_bot_cache_evictions_total counter\n";
+        for (auto &[name, c] : caches)
+            out += fmt::format("discord_bot_cache_evictions_total{{cache=\"{}\"}} {}\n", name, c.evict.load());
+
+        for (auto &[name, fn] : gauges) {
+            out += fmt::format("# TYPE discord_bot_{} gauge\n", name);
+            out += fmt::format("discord_bot_{} {}\n", name, fn());
+        }
+
+        return out;
+    }
+
+    std::string summary() {
+        std::unique_lock<std::mutex> lock(m);
+        std::string out = "```\n";
+
+        for (auto &[name, h] : handlers) {
+            uint64_t count = h.count;
+            if (!count) continue;
+            out += fmt::format("{:<32} {:>8} calls  {:>8.1f} ms mean  {:>6} ms p99\n", name, count, h.sum_ns / 1e6 / count, h.quantile(0.99) * 1000);
+        }
+
+        for (auto &[name, c] : caches) {
+            uint64_t hit = c.hit, miss = c.miss;
+            if (!hit && !miss) continue;
+            out += fmt::format("{:<32} {:>7.1f}% hits  {:>8} misses  {:>8} fills  {:>8} evicted\n", name, 100.0 * hit / (hit + miss), miss, c.fill.load(), c.evict.load());
+        }
+
+        for (auto &[name, fn] : gauges)
+            out += fmt::format("{:<32} {}\n", name, fn());
+
+        return out + "```";
+    }
+
+    int write_file(const std::string &path) {
+        return BotJournal::write_atomic(path, prometheus());
+    }
+
+    private:
+
+    std::mutex m;
+    std::map<std::string, histogram, std::less<>> handlers;
+    std::map<std::string, cache_counters, std::less<>> caches;
+    std::vector<std::pair<std::string, std::function<double()>>> gauges;
+};
+
+/*
+ * Every REST call and timer Program uses. ClusterBackend forwards to the
+ * dpp::cluster, FakeBackend answers from fixtures so Program can run offline.
+ */
+struct DiscordBackend {
+    using done_type = std::function<void(const dpp::confirmation_callback_t&)>;
+    using json_done_type = std::function<void(nlohmann::json&, const dpp::http_request_completion_t&)>;
+
+    virtual ~DiscordBackend() = default;
+
+    virtual void guild_get(dpp::snowflake guild_id, done_type done) = 0;
+    virtual void user_get(dpp::snowflake user_id, done_type done) = 0;
+    virtual void channel_get(dpp::snowflake channel_id, done_type done) = 0;
+    virtual void roles_get(dpp::snowflake guild_id, done_type done) = 0;
+    virtual void guild_get_member(dpp::snowflake guild_id, dpp::snowflake user_id, done_type done) = 0;
+    virtual void guild_members_page(dpp::snowflake guild_id, dpp::snowflake after, uint16_t limit, json_done_type done) = 0;
+    virtual void guild_member_add_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) = 0;
+    virtual void guild_member_delete_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) = 0;
+    virtual void role_create(const dpp::role &role, done_type done) = 0;
+    virtual void message_create(const dpp::message &m, done_type done) = 0;
+    virtual void interaction_response(const dpp::interaction_create_t &e, dpp::interaction_response_type type, const dpp::message &m, done_type done) = 0;
+    virtual void interaction_response_edit(const std::string &token, const dpp::message &m, done_type done) = 0;
+    virtual void current_user_get_guilds(done_type done) = 0;
+    virtual void global_commands_get(done_type done) = 0;
+    virtual void global_command_create(const dpp::slashcommand &c, done_type done) = 0;
+    virtual void global_command_edit(const dpp::slashcommand &c, done_type done) = 0;
+    virtual void global_command_delete(dpp::snowflake id, done_type done) = 0;
+
+    // Runs fn once after the given number of seconds
+    virtual void after(uint64_t seconds, std::function<void()> fn) = 0;
+};
+
+struct ClusterBackend : public DiscordBackend {
+    dpp::cluster &bot;
+
+    ClusterBackend(dpp::cluster &cluster):bot(cluster) { }
+
+    void guild_get(dpp::snowflake guild_id, done_type done) override { bot.guild_get(guild_id, done); }
+    void user_get(dpp::snowflake user_id, done_type done) override { bot.user_get(user_id, done); }
+    void channel_get(dpp::snowflake channel_id, done_type done) override { bot.channel_get(channel_id, done); }
+    void roles_get(dpp::snowflake guild_id, done_type done) override { bot.roles_get(guild_id, done); }
+
+    void guild_get_member(dpp::snowflake guild_id, dpp::snowflake user_id, done_type done) override {
+        bot.guild_get_member(guild_id, user_id, done);
+    }
+
+    // guild_get_members only hands back guild_member objects, the raw list also carries the users
+    void guild_members_page(dpp::snowflake guild_id, dpp::snowflake after, uint16_t limit, json_done_type done) override {
+        bot.post_rest(API_PATH "/guilds", guild_id.str(), fmt::format("members?limit={}&after={}", limit, (uint64_t)after), dpp::m_get, "", done);
+    }
+
+    void guild_member_add_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) override {
+        bot.guild_member_add_role(guild_id, user_id, role_id, done);
+    }
+
+    void guild_member_delete_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) override {
+        bot.guild_member_delete_role(guild_id, user_id, role_id, done);
+    }
+
+    void role_create(const dpp::role &role, done_type done) override { bot.role_create(role, done); }
+    void message_create(const dpp::message &m, done_type done) override { bot.message_create(m, done); }
+
+    void interaction_response(const dpp::interaction_create_t &e, dpp::interaction_response_type type, const dpp::message &m, done_type done) override {
+        e.reply(type, m, done);
+    }
+
+    void interaction_response_edit(const std::string &token, const dpp::message &m, done_type done) override {
+        bot.interaction_response_edit(token, m, done);
+    }
+
+    void current_user_get_guilds(done_type done) override { bot.current_user_get_guilds(done); }
+    void global_commands_get(done_type done) override { bot.global_commands_get(done); }
+    void global_command_create(const dpp::slashcommand &c, done_type done) override { bot.global_command_create(c, done); }
+    void global_command_edit(const dpp::slashcommand &c, done_type done) override { bot.global_command_edit(c, done); }
+    void global_command_delete(dpp::snowflake id, done_type done) override { bot.global_command_delete(id, done); }
+
+    // Always goes through the timer thread, a caller holding a lock or looping on co_sleep never resumes inline
+    void after(uint64_t seconds, std::function<void()> fn) override {
+        bot.start_timer([this, fn](dpp::timer t) {
+            bot.stop_timer(t);
+            fn();
+        }, std::max<uint64_t>(seconds, 1));
+    }
+};
+
+/*
+ * In-process stand-in for Discord. Guilds, members, roles and channels come
+ * from a fixture document, role changes and created roles are applied to it.
+ * Every call completes on the fake's own thread after latency (+ jitter) and
+ * fails with error_rate or a 429 with ratelimit_rate, drawn from a seeded RNG
+ * so a run with the same call order is reproducible.
+ *
+ * Fixture format:
+ * { "me": {user}, "guilds": [ { "guild": {guild}, "roles": [{role}], "channels": [{channel}], "members": [{member with "user"}] } ] }
+ */
+struct FakeBackend : public DiscordBackend {
+    using clock = std::chrono::steady_clock;
+
+    std::chrono::microseconds latency{0};
+    std::chrono::microseconds jitter{0};
+    double error_rate = 0;
+    double ratelimit_rate = 0;
+    double time_scale = 1;
+
+    dpp::user me;
+
+    std::atomic<uint64_t> calls = 0;
+    std::atomic<uint64_t> errors = 0;
+    std::atomic<uint64_t> ratelimited = 0;
+    std::atomic<uint64_t> messages = 0;
+    std::atomic<uint64_t> replies = 0;
+    std::atomic<uint64_t> role_changes = 0;
+
+    FakeBackend(uint64_t seed = 1):rng(seed) {
+        worker = std::thread(&FakeBackend::run, this);
+    }
+
+    ~FakeBackend() {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            stopping = true;
+            cv.notify_all();
+        }
+        worker.join();
+    }
+
+    int load_fixtures(const nlohmann::json &j) {
+        std::unique_lock<std::mutex> lock(data_lock);
+
+        if (j.contains("me")) {
+            auto me_json = j["me"];
+            me.fill_from_json(&me_json);
+        }
+
+        for (auto g : j.value("guilds", nlohmann::json::array())) {
+            auto &guild_json = g["guild"];
+            dpp::guild guild;
+            guild.fill_from_json(&guild_json);
+
+            auto &fixture = guilds[guild.id];
+            fixture.guild = guild;
+
+            for (auto &r : g.value("roles", nlohmann::json::array())) {
+                auto role_json = r;
+                dpp::role role;
+                role.fill_from_json(guild.id, &role_json);
+                fixture.roles[role.id] = role;
+            }
+
+            for (auto &c : g.value("channels", nlohmann::json::array())) {
+                auto channel_json = c;
+                dpp::channel channel;
+                channel.fill_from_json(&channel_json);
+                channel.guild_id = guild.id;
+                channels[channel.id] = channel;
+            }
+
+            for (auto &member : g.value("members", nlohmann::json::array())) {
+                dpp::snowflake user_id = json_id(member["user"]["id"]);
+                fixture.members[user_id] = member;
+                users[user_id] = member["user"];
+            }
+        }
+
+        return 0;
+    }
+
+    // Synthetic fixtures, ids are dense so they are easy to address from a benchmark
+    static nlohmann::json generate_fixtures(size_t guild_count, size_t members, size_t roles) {
+        auto id = [](uint64_t kind, uint64_t n) { return std::to_string(kind << 40 | n); };
+        auto guilds = nlohmann::json::array();
+
+        for (size_t g = 1; g <= guild_count; g++) {
+            nlohmann::json guild = {
+                { "guild", { { "id", id(1, g) }, { "name", fmt::format("guild-{}", g) }, { "owner_id", id(3, 1) }, { "system_channel_id", id(4, g) } } },
+                { "roles", nlohmann::json::array() },
+                { "channels", { { { "id", id(4, g) }, { "name", "welcome" }, { "type", 0 }, { "guild_id", id(1, g) } } } },
+                { "members", nlohmann::json::array() }
+            };
+
+            for (size_t r = 0; r < roles; r++)
+                guild["roles"].push_back({ { "id", id(2, g << 16 | r) }, { "name", r ? fmt::format("role-{}", r) : "@everyone" }, { "position", r } });
+
+            for (size_t u = 1; u <= members; u++)
+                guild["members"].push_back({
+                    { "user", { { "id", id(3, u) }, { "username", fmt::format("user-{}", u) }, { "global_name", fmt::format("User {}", u) } } },
+                    { "roles", nlohmann::json::array() },
+                    { "joined_at", "2024-01-01T00:00:00.000000+00:00" }
+                });
+
+            guilds.push_back(std::move(guild));
+        }
+
+        return { { "me", { { "id", id(3, 0) }, { "username", "fake-bot" }, { "bot", true } } }, { "guilds", guilds } };
+    }
+
+    void guild_get(dpp::snowflake guild_id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto it = guilds.find(guild_id);
+        if (it == guilds.end()) return fail(std::move(done), 404);
+        respond(std::move(done), it->second.guild);
+    }
+
+    void user_get(dpp::snowflake user_id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto it = users.find(user_id);
+        if (it == users.end()) return fail(std::move(done), 404);
+        dpp::user_identified user;
+        user.fill_from_json(&it->second);
+        respond(std::move(done), user);
+    }
+
+    void channel_get(dpp::snowflake channel_id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto it = channels.find(channel_id);
+        if (it == channels.end()) return fail(std::move(done), 404);
+        respond(std::move(done), it->second);
+    }
+
+    void roles_get(dpp::snowflake guild_id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto it = guilds.find(guild_id);
+        if (it == guilds.end()) return fail(std::move(done), 404);
+        respond(std::move(done), it->second.roles);
+    }
+
+    void guild_get_member(dpp::snowflake guild_id, dpp::snowflake user_id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto *member = find_member(guild_id, user_id);
+        if (!member) return fail(std::move(done), 404);
+        dpp::guild_member result;
+        result.fill_from_json(member, guild_id, user_id);
+        respond(std::move(done), result);
+    }
+
+    void guild_members_page(dpp::snowflake guild_id, dpp::snowflake after, uint16_t limit, json_done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto page = nlohmann::json::array();
+        if (auto it = guilds.find(guild_id); it != guilds.end())
+            for (auto m = it->second.members.upper_bound(after); m != it->second.members.end() && page.size() < limit; m++)
+                page.push_back(m->second);
+
+        schedule(roll(), [done = std::move(done), page = std::move(page)](const dpp::http_request_completion_t &http) mutable {
+            auto j = http.status == 200 ? page : nlohmann::json::parse(http.body);
+            done(j, http);
+        });
+    }
+
+    void guild_member_add_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) override {
+        change_role(guild_id, user_id, role_id, true, std::move(done));
+    }
+
+    void guild_member_delete_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, done_type done) override {
+        change_role(guild_id, user_id, role_id, false, std::move(done));
+    }
+
+    void role_create(const dpp::role &role, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto it = guilds.find(role.guild_id);
+        if (it == guilds.end()) return fail(std::move(done), 404);
+        auto http = roll();
+        dpp::role created = role;
+        if (http.status == 200) {
+            created.id = next_id++;
+            it->second.roles[created.id] = created;
+        }
+        respond(http, std::move(done), created);
+    }
+
+    void message_create(const dpp::message &m, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto http = roll();
+        dpp::message sent = m;
+        if (http.status == 200) {
+            messages++;
+            sent.id = next_id++;
+        }
+        respond(http, std::move(done), sent);
+    }
+
+    void interaction_response(const dpp::interaction_create_t &, dpp::interaction_response_type, const dpp::message &, done_type done) override {
+        replies++;
+        respond(std::move(done), dpp::confirmation());
+    }
+
+    void interaction_response_edit(const std::string &, const dpp::message &m, done_type done) override {
+        respond(std::move(done), m);
+    }
+
+    void current_user_get_guilds(done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        dpp::guild_map result;
+        for (auto &[id, fixture] : guilds)
+            result[id] = fixture.guild;
+        respond(std::move(done), result);
+    }
+
+    void global_commands_get(done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        respond(std::move(done), commands);
+    }
+
+    void global_command_create(const dpp::slashcommand &c, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto http = roll();
+        auto created = c;
+        if (http.status == 200) {
+            created.id = next_id++;
+            commands[created.id] = created;
+        }
+        respond(http, std::move(done), created);
+    }
+
+    void global_command_edit(const dpp::slashcommand &c, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto http = roll();
+        if (http.status == 200)
+            commands[c.id] = c;
+        respond(http, std::move(done), dpp::confirmation());
+    }
+
+    void global_command_delete(dpp::snowflake id, done_type done) override {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto http = roll();
+        if (http.status == 200)
+            commands.erase(id);
+        respond(http, std::move(done), dpp::confirmation());
+    }
+
+    void after(uint64_t seconds, std::function<void()> fn) override {
+        auto delay = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds * time_scale));
+        enqueue(clock::now() + delay, [fn = std::move(fn)]() { fn(); });
+    }
+
+    private:
+
+    struct fake_guild {
+        dpp::guild guild;
+        dpp::role_map roles;
+        std::map<dpp::snowflake, nlohmann::json> members;
+    };
+
+    struct pending_call {
+        clock::time_point due;
+        uint64_t seq;
+        std::function<void()> fn;
+
+        bool operator>(const pending_call &other) const {
+            return std::tie(due, seq) > std::tie(other.due, other.seq);
+        }
+    };
+
+    std::mutex data_lock;
+    std::map<dpp::snowflake, fake_guild> guilds;
+    std::map<dpp::snowflake, nlohmann::json> users;
+    std::map<dpp::snowflake, dpp::channel> channels;
+    dpp::slashcommand_map commands;
+    uint64_t next_id = 9ULL << 40;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::priority_queue<pending_call, std::vector<pending_call>, std::greater<>> queue;
+    uint64_t seq = 0;
+    bool stopping = false;
+    std::mt19937_64 rng;
+    std::thread worker;
+
+    static uint64_t json_id(const nlohmann::json &j) {
+        return j.is_string() ? std::stoull(j.template get<std::string>()) : j.template get<uint64_t>();
+    }
+
+    nlohmann::json *find_member(dpp::snowflake guild_id, dpp::snowflake user_id) {
+        auto it = guilds.find(guild_id);
+        if (it == guilds.end()) return nullptr;
+        auto member = it->second.members.find(user_id);
+        return member == it->second.members.end() ? nullptr : &member->second;
+    }
+
+    void change_role(dpp::snowflake guild_id, dpp::snowflake user_id, dpp::snowflake role_id, bool add, done_type done) {
+        std::unique_lock<std::mutex> lock(data_lock);
+        auto *member = find_member(guild_id, user_id);
+        if (!member) return fail(std::move(done), 404);
+
+        // A failed or rate limited call must leave the fixture as it was
+        auto http = roll();
+        if (http.status == 200) {
+            auto &roles = (*member)["roles"];
+            auto id = std::to_string((uint64_t)role_id);
+            auto it = std::find(roles.begin(), roles.end(), id);
+            if (add && it == roles.end()) roles.push_back(id);
+            if (!add && it != roles.end()) roles.erase(it);
+            role_changes++;
+        }
+        respond(http, std::move(done), dpp::confirmation());
+    }
+
+    // Picks the outcome of a call, 200, 429 or 500
+    dpp::http_request_completion_t roll() {
+        std::unique_lock<std::mutex> lock(m);
+        calls++;
+        dpp::http_request_completion_t http;
+        double r = std::uniform_real_distribution<double>(0, 1)(rng);
+
+        if (r < ratelimit_rate) {
+            ratelimited++;
+            http.status = 429;
+            http.ratelimit_retry_after = 1;
+            http.body = R"({"message": "You are being rate limited.", "retry_after": 1, "global": false})";
+        } else if (r < ratelimit_rate + error_rate) {
+            errors++;
+            http.status = 500;
+            http.body = R"({"message": "Fake backend error", "code": 0})";
+        } else {
+            http.status = 200;
+            http.body = "{}";
+        }
+        return http;
+    }
+
+    void respond(done_type done, dpp::confirmable_t value) {
+        respond(roll(), std::move(done), std::move(value));
+    }
+
+    // For calls that change fixtures, the outcome is rolled before anything is touched
+    void respond(dpp::http_request_completion_t http, done_type done, dpp::confirmable_t value) {
+        schedule(http, [done = std::move(done), value = std::move(value)](const dpp::http_request_completion_t &http) {
+            if (http.status == 200)
+                done(dpp::confirmation_callback_t(nullptr, value, http));
+            else
+                done(dpp::confirmation_callback_t(http));
+        });
+    }
+
+    void fail(done_type done, uint32_t status) {
+        dpp::http_request_completion_t http;
+        http.status = status;
+        http.body = R"({"message": "Unknown", "code": 10000})";
+        schedule(http, [done = std::move(done)](const dpp::http_request_completion_t &http) {
+            done(dpp::confirmation_callback_t(http));
+        });
+    }
+
+    template<typename F>
+    void schedule(dpp::http_request_completion_t http, F &&fn) {
+        auto delay = latency;
+        if (jitter.count()) {
+            std::unique_lock<std::mutex> lock(m);
+            delay += std::chrono::microseconds(rng() % jitter.count());
+        }
+        enqueue(clock::now() + delay, [http, fn = std::forward<F>(fn)]() mutable { fn(http); });
+    }
+
+    void enqueue(clock::time_point due, std::function<void()> fn) {
+        std::unique_lock<std::mutex> lock(m);
+        queue.push({ due, seq++, std::move(fn) });
+        cv.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m);
+        while (!stopping) {
+            if (queue.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+            auto due = queue.top().due;
+            if (clock::now() < due) {
+                cv.wait_until(lock, due);
+                continue;
+            }
+            auto fn = std::move(const_cast<pending_call&>(queue.top()).fn);
+            queue.pop();
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    }
+};
+
+struct Program : public BotData {
+    std::function<void(const dpp::confirmation_callback_t&)> confirmation_handler;
+    std::function<dpp::task<void>(const dpp::ready_t&)> ready_handler;
+    std::function<dpp::task<void>(const dpp::slashcommand_t&)> slashcommand_handler;
+    std::function<dpp::task<void>(const dpp::guild_member_add_t&)> guild_user_add_handler;
+    std::function<void(const dpp::message_create_t&)> message_handler;
+    std::function<dpp::task<void>(const dpp::button_click_t&)> button_click_handler;
+    std::function<void(const dpp::guild_role_create_t&)> role_create_handler;
+    std::function<void(const dpp::guild_role_update_t&)> role_update_handler;
+    std::function<void(const dpp::guild_role_delete_t&)> role_delete_handler;
+
+    std::function<void(int)> signal_handler;
+    
+    bool did_init = false;
+    bool did_load = false;
+
+    util::coalescer<dpp::snowflake, GuildData*> guild_requests;
+    util::coalescer<dpp::snowflake, UserData*> user_requests;
+    util::coalescer<dpp::snowflake, ChannelData*> channel_requests;
+    util::coalescer<std::pair<dpp::snowflake, dpp::snowflake>, GuildUserData*> guild_user_requests;
+    util::coalescer<dpp::snowflake, bool> guild_role_requests;
+    util::coalescer<std::pair<dpp::snowflake, std::string>, GuildRoleData*> role_create_requests;
+
+    RestScheduler rest;
+    GuildExecutor executor;
+
+    // Set before load() to run against something other than the cluster
+    std::unique_ptr<DiscordBackend> backend;
+
+    util::log_limiter message_trace{ 20 };
+
+    BotMetrics metrics;
+    std::vector<BotMetrics::histogram*> command_latency;
+    BotMetrics::histogram *verify_latency;
+    BotMetrics::histogram *guild_user_add_latency;
+    BotMetrics::histogram *message_latency;
+    BotMetrics::cache_counters *guilds_cache;
+    BotMetrics::cache_counters *users_cache;
+    BotMetrics::cache_counters *channels_cache;
+    BotMetrics::cache_counters *guild_users_cache;
+    BotMetrics::cache_counters *guild_roles_cache;
+    BotMetrics::cache_counters *guild_channels_cache;
+
+    // Joins waiting for their guild's welcome post, an entry lives from the first join until its flush
+    struct welcome_batch {
+        dpp::snowflake channel_id;
+        std::vector<std::string> mentions;
+        bool scheduled = false;
+    };
+
+    std::mutex welcome_lock;
+    std::map<dpp::snowflake, welcome_batch> welcomes;
+    // Built once per guild and kept across flushes, rebuilt when the welcome channel changes
+    std::map<dpp::snowflake, dpp::message> welcome_skeletons;
+
+    std::atomic<bool> commands_syncing = false;
+
+    Program() {
+        register_metrics();
+    }
+
+    void register_metrics() {
+        for (auto &spec : commands())
+            command_latency.push_back(spec.handler ? &metrics.handler(fmt::format("slashcommand {}{}{}", spec.command, spec.subcommand.empty() ? "" : " ", spec.subcommand)) : nullptr);
+
+        verify_latency = &metrics.handler("on_user_verify");
+        guild_user_add_latency = &metrics.handler("handle_guild_user_add");
+        message_latency = &metrics.handler("handle_message");
+
+        guilds_cache = &metrics.cache("guilds");
+        users_cache = &metrics.cache("users");
+        channels_cache = &metrics.cache("channels");
+        guild_users_cache = &metrics.cache("guild_users");
+        guild_roles_cache = &metrics.cache("guild_roles");
+        guild_channels_cache = &metrics.cache("guild_channels");
+
+        metrics.gauge("outstanding_guild_requests", [this]() { return guild_requests.pending(); });
+        metrics.gauge("outstanding_user_requests", [this]() { return user_requests.pending(); });
+        metrics.gauge("outstanding_channel_requests", [this]() { return channel_requests.pending(); });
+        metrics.gauge("outstanding_guild_user_requests", [this]() { return guild_user_requests.pending(); });
+        metrics.gauge("outstanding_guild_role_requests", [this]() { return guild_role_requests.pending(); });
+        metrics.gauge("rest_inflight", [this]() { return rest.inflight_count(); });
+        for (size_t i = 0; i < rp_count; i++)
+            metrics.gauge(fmt::format("rest_queue_{}", RestScheduler::class_names[i]), [this, i]() { return rest.stats[i].depth.load(); });
+        metrics.gauge("cache_bytes_users", [this]() { return user_bytes(); });
+        metrics.gauge("cache_bytes_channels", [this]() { return channel_bytes(); });
+        metrics.gauge("cache_bytes_guilds", [this]() { return guild_bytes(); });
+        metrics.gauge("interned_strings", []() { return util::string_pool::get().count.load(); });
+        metrics.gauge("interned_bytes", []() { return util::string_pool::get().bytes.load(); });
+    }
+
+    virtual int init() {
+        confirmation_handler = std::bind(&Program::handle_confirm, this, std::placeholders::_1);
+        ready_handler = std::bind(&Program::handle_ready, this, std::placeholders::_1);
+        guild_user_add_handler = std::bind(&Program::handle_guild_user_add, this, std::placeholders::_1);
+        message_handler = std::bind(&Program::handle_message, this, std::placeholders::_1);
+        button_click_handler = std::bind(&Program::handle_button_click, this, std::placeholders::_1);
+        role_create_handler = std::bind(&Program::handle_role_create, this, std::placeholders::_1);
+        role_update_handler = std::bind(&Program::handle_role_update, this, std::placeholders::_1);
+        role_delete_handler = std::bind(&Program::handle_role_delete, this, std::placeholders::_1);
+        slashcommand_handler = std::bind(&Program::handle_slashcommand, this, std::placeholders::_1);
+        signal_handler = std::bind(&Program::handle_signal, this, std::placeholders::_1);
+
+        did_init = true;
+        return 0;
+    }
+
+    virtual int load() {
+        if (!did_init)
+            if (this->init())
+                return -1;
+
+        load_config();
+        if (check_sharding())
+            handle_error("Invalid sharding config");
+        if (check_intervals())
+            handle_error("Invalid interval in config");
+        keep_dpp_objects = cache_dpp_objects;
+        load_data();
+
+        if (load_token())
+            handle_error("No token supplied");
+
+        new (&bot) dpp::cluster(token, dpp::i_guilds | dpp::i_default_intents | dpp::i_guild_members | dpp::i_message_content,
+            shard_count, cluster_id, cluster_count);
+
+        if (is_partitioned())
+            log("Cluster %u of %u, %u shards\n", cluster_id, cluster_count, shard_count);
+
+        // Guild events leave the DPP thread right away, the executor starts each guild's handlers in order
+        bot.on_ready(ready_handler);
+        bot.on_guild_member_add([this](const dpp::guild_member_add_t &e) {
+            executor.post(e.adding_guild.id, [this, e]() { detach(guild_user_add_handler(e)); });
+        });
+        bot.on_message_create([this](const dpp::message_create_t &e) {
+            executor.post(e.msg.guild_id, [this, e]() { message_handler(e); });
+        });
+        bot.on_button_click([this](const dpp::button_click_t &e) {
+            executor.post(e.command.guild_id, [this, e]() { detach(button_click_handler(e)); });
+        });
+        bot.on_guild_role_create([this](const dpp::guild_role_create_t &e) {
+            executor.post(e.created.guild_id, [this, e]() { role_create_handler(e); });
+        });
+        bot.on_guild_role_update([this](const dpp::guild_role_update_t &e) {
+            executor.post(e.updated.guild_id, [this, e]() { role_update_handler(e); });
+        });
+        bot.on_guild_role_delete([this](const dpp::guild_role_delete_t &e) {
+            executor.post(e.deleting_guild.id, [this, e]() { role_delete_handler(e); });
+        });
+        bot.on_slashcommand([this](const dpp::slashcommand_t &e) {
+            executor.post(e.command.guild_id, [this, e]() { detach(slashcommand_handler(e)); });
+        });
+
+        if (!backend)
+            backend = std::make_unique<ClusterBackend>(bot);
+
+        rest.start();
+        start_executor();
+
+        logs("Connecting");
+
+        did_load = true;
+        return 0;
+    }
+
+    void start_executor() {
+        executor.start(pool_size);
+        for (size_t i = 0; i < executor.size(); i++)
+            metrics.gauge(fmt::format("executor_queue_{}", i), [this, i]() { return executor.stats(i).depth.load(); });
+        log("Executor running %lu workers\n", executor.size());
+    }
+
+    // Keeps a coroutine handler alive after the executor task that started it returns
+    static dpp::job detach(dpp::task<void> task) {
+        co_await std::move(task);
+    }
+
+    // Offline maintenance commands, run instead of connecting
+    virtual int command(int argc, char **argv) {
+        std::string name = argv[0];
+
+        load_config();
+        if (check_sharding()) return -1;
+
+        std::string path = argc > 1 ? argv[1] : bot_data_file;
+
+        if (name == "export-json") {
+            // Clusters hold different guilds, each exports to its own file
+            if (argc <= 1) path = partition_path(bot_data_file);
+            if (load_data()) return -1;
+            int ret = export_json(path);
+            // A read-only run, the snapshot on disk stays as it was
+            journal.close(false);
+            return ret;
+        }
+
+        if (name == "import-json")
+            return import_json(path);
+
+        if (name == "merge-json" && argc > 2)
+            return merge_json(path, std::vector<std::string>(argv + 2, argv + argc));
+
+        if (name == "simulate")
+            return simulate(argc > 1 ? argv[1] : "");
+
+        fprintf(stderr, "Usage: Discord-Bot [export-json|import-json|simulate] [path]\n       Discord-Bot merge-json out in...\n");
+        return -1;
+    }
+
+    // Nothing queued or in flight, neither in the scheduler nor in the coalescers
+    bool busy() {
+        if (rest.inflight_count()) return true;
+        for (auto &s : rest.stats)
+            if (s.depth) return true;
+        return guild_requests.pending() || user_requests.pending() || channel_requests.pending()
+            || guild_user_requests.pending() || guild_role_requests.pending() || role_create_requests.pending();
+    }
+
+    bool wait_idle(std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int quiet = 0;
+        while (std::chrono::steady_clock::now() < deadline) {
+            // A job picks up its next request right after the previous one completes, wait for a few quiet polls
+            quiet = busy() ? 0 : quiet + 1;
+            if (quiet == 5) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    FakeBackend *use_fake_backend(const nlohmann::json &fixtures) {
+        auto fake = std::make_unique<FakeBackend>();
+        fake->load_fixtures(fixtures);
+        bot.me = fake->me;
+
+        auto *ptr = fake.get();
+        backend = std::move(fake);
+        rest.start();
+        return ptr;
+    }
+
+    // Runs the ready sequence against the fake backend, nothing is read from or written to disk
+    int simulate(const std::string &fixtures_path) {
+        nlohmann::json fixtures;
+
+        if (fixtures_path.size()) {
+            std::string content;
+            if (util::read_file(fixtures_path, content)) {
+                log_config(fmt::format("Could not read fixtures {}\n", fixtures_path));
+                return -1;
+            }
+            fixtures = nlohmann::json::parse(content, nullptr, false);
+            if (fixtures.is_discarded()) {
+                log_config(fmt::format("Invalid fixtures {}\n", fixtures_path));
+                return -1;
+            }
+        } else {
+            fixtures = FakeBackend::generate_fixtures(10, 1000, 20);
+        }
+
+        metrics_file.clear();
+        auto *fake = use_fake_backend(fixtures);
+        fake->latency = std::chrono::milliseconds(2);
+        fake->jitter = std::chrono::milliseconds(3);
+        fake->error_rate = 0.01;
+        fake->ratelimit_rate = 0.01;
+        fake->time_scale = 0.01;
+
+        auto start = std::chrono::steady_clock::now();
+        auto ready = on_ready();
+        bool idle = wait_idle(std::chrono::seconds(120));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        log("Simulated ready in %.2f s%s: %lu guilds, %lu users, %lu calls, %lu errors, %lu rate limited\n",
+            seconds, idle ? "" : " (timed out)", guilds.size(), users.size(), fake->calls.load(), fake->errors.load(), fake->ratelimited.load());
+        util::log_write(util::ll_info, {}, metrics.summary() + "\n");
+
+        rest.stop();
+        rest.log_stats();
+        return idle ? 0 : -1;
+    }
+
+    virtual int save() {
+        executor.stop();
+        executor.log_stats();
+        rest.stop();
+        rest.log_stats();
+        save_data();
 
         return 0;
     }
@@ -454,7 +4324,7 @@ struct Program : public BotData {
     }
 
     virtual void handle_error(const char *error, int errcode = -1) {
-        fprintf(stderr, "Error: %s\n", error);
+        log_with(util::ll_error, util::log_fields(), "Error: %s\n", error);
         safe_exit(errcode);
     }
 
@@ -480,46 +4350,40 @@ struct Program : public BotData {
         return log("%s\n", str.c_str());
     }
 
-    int logs(const dpp::component &c) {
-        int sum = 0;
-        if (c.content.size() > 0)
-            sum += log("%s", c.content);
-        return sum + logs(c.components);
-    }
-
-    int logs(const std::vector<dpp::component> &c) {
-        int sum = 0;
-        for (const auto &_c : c)
-            sum += logs(_c);
-        return sum;
+    void append_components(std::string &out, const std::vector<dpp::component> &c) {
+        for (const auto &_c : c) {
+            out += _c.content;
+            append_components(out, _c.components);
+        }
     }
 
+    // Per message trace, debug level so default builds compile it out
     int logs(const dpp::message &m) {
-        return logs(m.components) + log("[%lu] %s \"%s\"\n", m.author.id, m.author.username.c_str(), m.content.c_str());
+        std::string components;
+        append_components(components, m.components);
+        return log_with(util::ll_debug, (util::log_fields{ m.guild_id, m.author.id, "message" }),
+            "%s[%lu] %s \"%s\"\n", components.c_str(), (uint64_t)m.author.id, m.author.username.c_str(), m.content.c_str());
     }
 
     virtual void guild_user_added(std::pair<const dpp::snowflake, GuildUserData> &pair) {
         auto &guser_data = pair.second;
-        auto &guser = guser_data.cached;
 
-        auto id = guser.user_id;
-        auto nickname = guser_data.nickname = guser.get_nickname();
+        auto id = guser_data.user_id;
+        guser_data.fetched_at = util::unix_now();
         auto username = guser_data.user->username;
         auto guild_id = guser_data.guild->id;
         auto guild_name = guser_data.guild->name;
 
-        log("Cached guser   [%lu] %s [%lu] %s\n", id, username.c_str(), guild_id, guild_name.c_str());
+        log_with(util::ll_debug, (util::log_fields{ guild_id, id }), "Cached guser   %s %s\n", username.c_str(), guild_name.c_str());
     }
 
     virtual void user_added(std::pair<const dpp::snowflake, UserData> &pair) {
         auto &user_data = pair.second;
-        auto &user = user_data.cached;
 
-        auto id = user_data.id = user.id;
-        auto name = user_data.username = user.username;
-        auto display = user_data.display_name = user.global_name;
+        auto id = user_data.id;
+        user_data.fetched_at = util::unix_now();
 
-        log("Cached user    [%lu] (%s) %s\n", id, name.c_str(), display.c_str());
+        log_with(util::ll_debug, (util::log_fields{ .user = id }), "Cached user    (%s) %s\n", user_data.username.c_str(), user_data.display_name.c_str());
     }
 
     virtual void guild_added(std::pair<const our_snowflake, GuildData> &pair) {
@@ -527,26 +4391,17 @@ struct Program : public BotData {
         auto &guild = data.cached;
 
         auto id = data.id = guild.id;
-        auto name = data.name = guild.name;
-
-        auto *welcome_channel = get_guild_channel(&data, guild.system_channel_id);
-
-        log("Cached guild   [%lu] %s\n", id, name.c_str());
-
-        if (welcome_channel) {
-            data.welcome_channel = welcome_channel->id;
-            log("\twelcome_channel [%lu] %s\n", welcome_channel->id, welcome_channel->name.c_str());
-        }
+        auto name = data.name = guild.name;
+
+        log("Cached guild   [%lu] %s\n", id, name.c_str());
     }
 
     virtual void channel_added(std::pair<const dpp::snowflake, ChannelData> &pair) {
         auto &data = pair.second;
-        auto &channel = data.cached;
 
-        auto id = data.id = channel.id;
-        auto name = data.name = channel.name;
+        data.fetched_at = util::unix_now();
 
-        log("Cached channel [%lu] %s\n", id, name.c_str());
+        log_with(util::ll_debug, util::log_fields(), "Cached channel [%lu] %s\n", (uint64_t)data.id, data.name.c_str());
     }    
 
     virtual void guild_channel_added(std::pair<const dpp::snowflake, GuildChannelData> &pair) {
@@ -560,242 +4415,481 @@ struct Program : public BotData {
         data.id = data.channel->id;
         data.name = data.channel->name;
 
-        log("Cached gchannel %p %p\n", data.guild, data.channel);
+        log_with(util::ll_debug, util::log_fields(), "Cached gchannel %p %p\n", data.guild, data.channel);
     }
 
     virtual void guild_role_added(std::pair<const dpp::snowflake, GuildRoleData> &pair) {
         auto &data = pair.second;
         auto *guild = data.guild;
-        auto &role = data.cached;
     
         assert(guild && "Guild null\n");
 
-        data.id = role.id;
-        data.name = role.name;
+        data.fetched_at = util::unix_now();
+        guild->index_role(&data);
 
-        log("Cached grole %p %lu\n", data.guild, data.id);
+        log_with(util::ll_debug, util::log_fields(), "Cached grole %p %lu\n", data.guild, (uint64_t)data.id);
     }
 
     virtual void role_added(std::pair<const dpp::snowflake, GuildRoleData> &pair) {
 
     }
 
-    GuildChannelData *get_guild_channel(GuildData *guild, const dpp::snowflake channel_id) {
+    dpp::task<GuildChannelData*> co_get_guild_channel(GuildData *guild, const dpp::snowflake channel_id) {
         assert(guild && "guild is null\n");
-        if (!guild->channels.contains(channel_id))
-            add_guild_channel(guild, channel_id);
-        return util::get_or_null(guild->channels, channel_id);
+        if (guild->channels.contains(channel_id)) {
+            guild_channels_cache->hit++;
+        } else {
+            guild_channels_cache->miss++;
+            co_await co_add_guild_channel(guild, channel_id);
+        }
+        co_return util::get_or_null(guild->channels, channel_id);
     }
 
-    GuildUserData *get_guild_user(GuildData *guild, const dpp::snowflake user_id) {
+    dpp::task<GuildUserData*> co_get_guild_user(GuildData *guild, const dpp::snowflake user_id) {
         assert(guild && "guild is null\n");
-        if (!guild->users.contains(user_id))
-            add_guild_user(guild->id, user_id);
-        return util::get_or_null(guild->users, user_id);
+        if (auto *cached = guild->get_user(user_id)) {
+            guild_users_cache->hit++;
+            co_return cached;
+        }
+        guild_users_cache->miss++;
+        co_return co_await guild_user_requests.get({ guild->id, user_id }, [this, guild_id = guild->id, user_id](auto done) {
+            guild_users_cache->fill++;
+            fetch_guild_user(guild_id, user_id, std::move(done));
+        });
     }
 
-    GuildRoleData *get_guild_role(GuildData *guild, const dpp::snowflake role_id) {
+    // Roles are fetched once per guild, after that the table is kept current by role events
+    dpp::task<void> co_sync_guild_roles(GuildData *guild) {
         assert(guild && "guild is null\n");
-        //return guild->get_role(role_id);
-        if (!guild->roles.contains(role_id))
-            add_guild_role(guild->id, role_id);
-        return util::get_or_null(guild->roles, role_id);
+        if (!guild->roles_synced)
+            co_await guild_role_requests.get(guild->id, [this, guild_id = guild->id](auto done) {
+                guild_roles_cache->fill++;
+                fetch_guild_roles(guild_id, std::move(done));
+            });
     }
 
-    GuildRoleData *get_guild_role(GuildData *guild, const std::string &role_name) {
+    dpp::task<GuildRoleData*> co_get_guild_role(GuildData *guild, const dpp::snowflake role_id) {
         assert(guild && "guild is null\n");
-        return guild->get_role(role_name);
-    }
-
-    ChannelData *get_channel(const dpp::snowflake channel_id) {
-        if (!channels.contains(channel_id))
-            add_channel(channel_id);
-        return util::get_or_null(channels, channel_id);
-    }
-
-    UserData *get_user(const dpp::snowflake &user_id) {
-        //log("get_user %lu\n", user_id);
-        if (!users.contains(user_id))
-            add_user(user_id);
-        return util::get_or_null(users, user_id);
+        if (!role_id) co_return nullptr;
+        if (guild->roles.contains(role_id)) {
+            guild_roles_cache->hit++;
+        } else {
+            guild_roles_cache->miss++;
+            co_await co_sync_guild_roles(guild);
+        }
+        co_return util::get_or_null(guild->roles, role_id);
     }
 
-    GuildData *get_guild(const dpp::snowflake guild_id) {
-        //log("get_guild %lu\n", guild_id);
-        if (!guilds.contains(guild_id))
-            add_guild(guild_id);
-        return util::get_or_null(guilds, guild_id);
+    dpp::task<GuildRoleData*> co_find_guild_role(GuildData *guild, const std::string role_name) {
+        assert(guild && "guild is null\n");
+        if (auto *cached = guild->get_role(role_name)) {
+            guild_roles_cache->hit++;
+            co_return cached;
+        }
+        guild_roles_cache->miss++;
+        co_await co_sync_guild_roles(guild);
+        co_return guild->get_role(role_name);
     }
 
-    ChannelData *get_channel(const dpp::channel &channel) {
-        return get_channel(channel.id);
+    dpp::task<ChannelData*> co_get_channel(const dpp::snowflake channel_id) {
+        if (auto *cached = util::get_or_null(channels, channel_id)) {
+            channels_cache->hit++;
+            co_return cached;
+        }
+        channels_cache->miss++;
+        co_return co_await channel_requests.get(channel_id, [this, channel_id](auto done) {
+            channels_cache->fill++;
+            fetch_channel(channel_id, std::move(done));
+        });
     }
 
-    GuildData *get_guild(const dpp::guild &guild) {
-        return get_guild(guild.id);
+    dpp::task<UserData*> co_get_user(const dpp::snowflake user_id) {
+        if (auto *cached = find_user(user_id)) {
+            users_cache->hit++;
+            co_return cached;
+        }
+        users_cache->miss++;
+        co_return co_await user_requests.get(user_id, [this, user_id](auto done) {
+            users_cache->fill++;
+            fetch_user(user_id, std::move(done));
+        });
     }
 
-    GuildUserData *get_guild_user(const dpp::guild_member &user) {
-        auto *guild_data = get_guild(user.guild_id);
-        //log("get_guild_user %lu %p %lu\n", user.guild_id, guild_data, user.user_id);
-        if (!guild_data) return nullptr;
-        return get_guild_user(guild_data, user.user_id);
+    dpp::task<GuildData*> co_get_guild(const dpp::snowflake guild_id) {
+        if (auto *cached = find_guild(guild_id)) {
+            guilds_cache->hit++;
+            co_return cached;
+        }
+        guilds_cache->miss++;
+        co_return co_await guild_requests.get(guild_id, [this, guild_id](auto done) {
+            guilds_cache->fill++;
+            fetch_guild(guild_id, std::move(done));
+        });
     }
 
-    UserData *get_user(const dpp::user &user) {
-        return get_user(user.id);
+    dpp::task<GuildUserData*> co_get_guild_user(const dpp::guild_member &user) {
+        auto *guild_data = co_await co_get_guild(user.guild_id);
+        if (!guild_data) co_return nullptr;
+        co_return co_await co_get_guild_user(guild_data, user.user_id);
     }
 
-    void add_channel(const dpp::snowflake channel_id, dpp::channel &channel) {
+    void add_channel(const dpp::snowflake channel_id, const dpp::channel &channel) {
         assert(channel_id && "channel_id should not be 0 here\n");
-        channel_added(*channels.emplace(std::make_pair(channel_id, channel)).first);
+        channel_added(*channels.emplace(channel_id, channel).first);
     }
 
-    void add_guild(const dpp::snowflake guild_id, dpp::guild &guild) {
+    void add_guild(const dpp::snowflake guild_id, const dpp::guild &guild) {
         assert(guild_id && "guild_id should not be 0 here\n");
-        guild_added(*guilds.emplace(std::make_pair(guild_id, guild)).first);
+        guild_added(*guilds.emplace(guild_id, guild).first);
     }
 
-    void add_user(const dpp::snowflake &user_id, dpp::user &user) {
+    void add_user(const dpp::snowflake &user_id, const dpp::user &user) {
         assert(user_id && "user_id should not be 0 here\n");
-        //log("add_user %lu %s\n", user_id, user.username.c_str());
-        user_added(*users.emplace(std::make_pair(user_id, user)).first);
+        user_added(*users.emplace(user_id, user).first);
     }
 
-    void add_guild_user(GuildData *guild_data, UserData *user_data, const dpp::snowflake &user_id, dpp::guild_member &guild_member) {
+    void add_guild_user(GuildData *guild_data, UserData *user_data, const dpp::snowflake &user_id, const dpp::guild_member &guild_member) {
         assert(user_id && "user_id should not be 0 here\n");
-        guild_user_added(*guild_data->users.emplace(std::make_pair(user_id, GuildUserData(user_data, guild_data, guild_member))).first);
+        // The guild may already be past the sweep's walk, keep the user from being evicted under the new member
+        if (user_data) user_data->touch();
+        guild_user_added(*guild_data->users.emplace(user_id, user_data, guild_data, guild_member).first);
     }
 
-    void add_guild_role(GuildData *guild_data, const dpp::snowflake &role_id, dpp::role &guild_role) {
+    void add_guild_role(GuildData *guild_data, const dpp::snowflake &role_id, const dpp::role &guild_role) {
         assert(role_id && "role_id should not be 0 here\n");
-        guild_role_added(*guild_data->roles.emplace(std::make_pair(role_id, GuildRoleData(guild_data, guild_role))).first);
+        guild_role_added(*guild_data->roles.emplace(role_id, guild_data, guild_role).first);
     }
 
     void add_guild_channel(GuildData *guild_data, ChannelData *channel_data, const dpp::snowflake &channel_id) {
         assert(guild_data && "guild_data is null\n");
         assert(channel_id && "channel_id should not be 0 here\n");
-        guild_channel_added(*guild_data->channels.emplace(std::make_pair(our_snowflake(channel_id), GuildChannelData(guild_data, channel_data))).first);
+        guild_channel_added(*guild_data->channels.emplace(channel_id, guild_data, channel_data).first);
     }
 
-    void add_guild_channel(GuildData *guild, const dpp::snowflake &channel_id) {
+    dpp::task<void> co_add_guild_channel(GuildData *guild, const dpp::snowflake channel_id) {
         assert(guild && "guild is null\n");
         if (!channel_id) {
             logs("Channel id is 0");
-            return;
+            co_return;
         }
 
-        auto *channel = get_channel(channel_id);
+        auto *channel = co_await co_get_channel(channel_id);
         
         if (!channel) {
             logs("No channel to associate with guild");
-            return;
+            co_return;
         }
 
         add_guild_channel(guild, channel, channel_id);
     }
 
-    void add_guild_user(dpp::guild_member &guild_member) {
-        auto *guild_data = get_guild(guild_member.guild_id);
-        auto *user_data = get_user(guild_member.user_id);
+    /*
+     * REST fillers for the coalescers above, each one is started at most once
+     * per key and reports back through done() from the REST thread
+     */
+
+    // Queues a call on the REST scheduler, start issues the DPP request with the completion it is given
+    util::shared_awaiter<dpp::confirmation_callback_t> co_rest(rest_priority priority, std::string route, RestScheduler::start_type start) {
+        auto result = std::make_shared<util::shared_result<dpp::confirmation_callback_t>>();
+        rest.submit(priority, std::move(route), std::move(start), [result](const dpp::confirmation_callback_t &cc) {
+            result->set(cc);
+        });
+        return { result };
+    }
+
+    util::shared_awaiter<bool> co_sleep(uint64_t seconds) {
+        auto result = std::make_shared<util::shared_result<bool>>();
+        backend->after(seconds, [result]() { result->set(true); });
+        return { result };
+    }
+
+    void rest_call(rest_priority priority, std::string route, RestScheduler::start_type start) {
+        rest.submit(priority, std::move(route), std::move(start), confirmation_handler);
+    }
+
+    void reply(const dpp::interaction_create_t &e, const dpp::message &m, dpp::interaction_response_type type = dpp::ir_channel_message_with_source) {
+        rest_call(rp_interaction, "interactions", [this, e, m, type](auto done) {
+            backend->interaction_response(e, type, m, done);
+        });
+    }
+
+    dpp::job fetch_guild_roles(dpp::snowflake guild_id, std::function<void(bool)> done) {
+        auto *guild = co_await co_get_guild(guild_id);
+        if (!guild) {
+            done(false);
+            co_return;
+        }
+
+        auto e = co_await co_rest(rp_cache, fmt::format("guilds/{}/roles", (uint64_t)guild_id), [this, guild_id](auto done) {
+            backend->roles_get(guild_id, done);
+        });
+        if (e.is_error()) {
+            handle_apierror(e.get_error(), fmt::format("guild: {} getroles", (uint64_t)guild_id));
+            done(false);
+            co_return;
+        }
         
+        auto &roles = std::get<dpp::role_map>(e.value);
+        for (auto &r : roles)
+            add_guild_role(guild, r.first, r.second);
+
+        guild->roles_fetched_at = util::unix_now();
+        guild->roles_synced = true;
+        done(true);
+    }
+
+    dpp::job fetch_guild_user(dpp::snowflake guild_id, dpp::snowflake user_id, std::function<void(GuildUserData*)> done) {
+        auto e = co_await co_rest(rp_verify, fmt::format("guilds/{}/members", (uint64_t)guild_id), [this, guild_id, user_id](auto done) {
+            backend->guild_get_member(guild_id, user_id, done);
+        });
+        if (e.is_error()) { 
+            handle_apierror(e.get_error(), fmt::format("guild: {} user: {}", (uint64_t)guild_id, (uint64_t)user_id));
+            done(nullptr);
+            co_return;
+        }
+
+        auto guild_member = std::get<dpp::guild_member>(e.value);
+        auto *guild_data = co_await co_get_guild(guild_member.guild_id);
+        auto *user_data = co_await co_get_user(guild_member.user_id);
+
         if (!guild_data) {
             logs("No guild to associate with user");
-            return;
+            done(nullptr);
+            co_return;
         }
 
         if (!user_data) {
             logs("No user to associate with guild");
-            return;
+            done(nullptr);
+            co_return;
         }
 
         add_guild_user(guild_data, user_data, guild_member.user_id, guild_member);
+        done(guild_data->get_user(user_id));
     }
 
-    void add_guild_user(GuildData *guild, const dpp::snowflake &user_id) {
-        add_guild_user(guild->id, user_id);
+    dpp::job fetch_guild(dpp::snowflake guild_id, std::function<void(GuildData*)> done) {
+        auto e = co_await co_rest(rp_cache, fmt::format("guilds/{}", (uint64_t)guild_id), [this, guild_id](auto done) {
+            backend->guild_get(guild_id, done);
+        });
+        if (e.is_error()) { 
+            handle_apierror(e.get_error(), fmt::format("guild: {}", (uint64_t)guild_id));
+            done(nullptr);
+            co_return;
+        }
+
+        add_guild(guild_id, std::get<dpp::guild>(e.value));
+
+        auto *data = find_guild(guild_id);
+        auto *welcome_channel = co_await co_get_guild_channel(data, data->cached.system_channel_id);
+
+        if (welcome_channel) {
+            data->welcome_channel = welcome_channel->id;
+            log("\twelcome_channel [%lu] %s\n", welcome_channel->id, welcome_channel->name.c_str());
+        }
+
+        record_guild(data);
+
+        done(data);
     }
 
-    void add_guild(std::pair<const dpp::snowflake, dpp::guild> &pair) {
-        add_guild(pair.first, pair.second);
+    dpp::job fetch_user(dpp::snowflake user_id, std::function<void(UserData*)> done) {
+        auto e = co_await co_rest(rp_cache, "users", [this, user_id](auto done) {
+            backend->user_get(user_id, done);
+        });
+        if (e.is_error()) { 
+            handle_apierror(e.get_error(), fmt::format("user: {}", (uint64_t)user_id));
+            done(nullptr);
+            co_return;
+        }
+
+        add_user(user_id, std::get<dpp::user_identified>(e.value));
+        done(find_user(user_id));
     }
 
-    void add_guild_role(const dpp::snowflake guild_id, const dpp::snowflake role_id) {
-        util::auto_wait w;
-        auto *guild = get_guild(guild_id);
-        if (!guild) return;
-        bot.roles_get(guild_id, [&,guild_id,role_id](dpp::confirmation_callback_t e) {
-            util::hold h(w);
-            if (e.is_error()) {
-                handle_apierror(e.get_error(), fmt::format("guild: {} getroles", (uint64_t)guild_id));
-                return;
-            }
-            
-            auto &roles = std::get<dpp::role_map>(e.value);
-            for (auto &r : roles) {
-                add_guild_role(guild, r.first, r.second);
-            }
+    dpp::job fetch_channel(dpp::snowflake channel_id, std::function<void(ChannelData*)> done) {
+        auto e = co_await co_rest(rp_cache, fmt::format("channels/{}", (uint64_t)channel_id), [this, channel_id](auto done) {
+            backend->channel_get(channel_id, done);
         });
+        if (e.is_error()) { 
+            handle_apierror(e.get_error(), fmt::format("channel: {}", (uint64_t)channel_id));
+            done(nullptr);
+            co_return;
+        }
+
+        add_channel(channel_id, std::get<dpp::channel>(e.value));
+        done(util::get_or_null(channels, channel_id));
     }
 
-    void add_guild_user(const dpp::snowflake guild_id, const dpp::snowflake user_id) {
-        //log("add_guild_user %lu %lu\n", guild_id, user_id);
-        util::auto_wait w;
-        bot.guild_get_member(guild_id, user_id, [&,guild_id,user_id](dpp::confirmation_callback_t e) {
-            util::hold h(w);
-            if (e.is_error()) { 
-                handle_apierror(e.get_error(), fmt::format("guild: {} user: {}", (uint64_t)guild_id, (uint64_t)user_id));
-                return;
-            }
+    /*
+     * The fresh entry is built outside the lock and copied over the old one under
+     * the shard's exclusive lock, so readers under the shard lock never see it half
+     * written. Pointers to the entry stay valid, a miss leaves the map as it is.
+     */
+    void refresh_user(const dpp::user &user) {
+        UserData fresh(user);
+        fresh.fetched_at = util::unix_now();
+        users.update(user.id, [&fresh](UserData &data) { data = std::move(fresh); });
+    }
 
-            add_guild_user(std::get<dpp::guild_member>(e.value));
-            //logs("done add_guild_user");
+    GuildUserData *refresh_guild_user(GuildData *guild, const dpp::guild_member &member) {
+        GuildUserData fresh(nullptr, guild, member);
+        fresh.fetched_at = util::unix_now();
+        return guild->users.update(member.user_id, [&fresh](GuildUserData &data) {
+            fresh.user = data.user;
+            data = std::move(fresh);
         });
     }
 
-    void add_guild(const dpp::snowflake guild_id) {
-        util::auto_wait w;
-        bot.guild_get(guild_id, [&,guild_id](dpp::confirmation_callback_t e) {
-            util::hold h(w);
-            if (e.is_error()) { 
-                handle_apierror(e.get_error(), fmt::format("guild: {}", (uint64_t)guild_id));
-                return;
-            }
+    void refresh_channel(const dpp::channel &channel) {
+        ChannelData fresh(channel);
+        fresh.fetched_at = util::unix_now();
+        channels.update(channel.id, [&fresh](ChannelData &data) { data = std::move(fresh); });
+    }
 
-            add_guild(guild_id, std::get<dpp::guild>(e.value));
+    /*
+     * Refetches users and channels older than cache_ttl, a few per second so a
+     * warm restart never competes with live traffic. Member lists and stale
+     * role tables are resynced per guild from on_ready.
+     */
+    dpp::job revalidate_caches() {
+        std::vector<dpp::snowflake> stale_users, stale_channels;
+
+        users.for_each([&](auto &pair) {
+            if (!is_fresh(pair.second.fetched_at)) stale_users.push_back(pair.first);
         });
+        channels.for_each([&](auto &pair) {
+            if (!is_fresh(pair.second.fetched_at)) stale_channels.push_back(pair.first);
+        });
+
+        log("Revalidating %lu users, %lu channels\n", stale_users.size(), stale_channels.size());
+
+        size_t n = 0;
+
+        for (auto id : stale_users) {
+            auto e = co_await co_rest(rp_cache, "users", [this, id](auto done) {
+                backend->user_get(id, done);
+            });
+            if (!e.is_error())
+                refresh_user(std::get<dpp::user_identified>(e.value));
+            if (++n % 10 == 0)
+                co_await co_sleep(1);
+        }
+
+        for (auto id : stale_channels) {
+            auto e = co_await co_rest(rp_cache, fmt::format("channels/{}", (uint64_t)id), [this, id](auto done) {
+                backend->channel_get(id, done);
+            });
+            if (!e.is_error())
+                refresh_channel(std::get<dpp::channel>(e.value));
+            if (++n % 10 == 0)
+                co_await co_sleep(1);
+        }
+
+        log("Revalidated %lu cache entries\n", n);
     }
 
-    void add_user(const dpp::snowflake user_id) {
-        //log("add_user %lu\n", user_id);
-        util::auto_wait w;
-        bot.user_get(user_id, [&,user_id](dpp::confirmation_callback_t e) {
-            util::hold h(w); 
-            if (e.is_error()) { 
-                handle_apierror(e.get_error(), fmt::format("user: {}", (uint64_t)user_id));
-                return;
-            }
+    struct member_page {
+        std::vector<std::pair<dpp::user, dpp::guild_member>> members;
+        bool error = false;
+    };
 
-            add_user(user_id, std::get<dpp::user_identified>(e.value));
-        });
+    static constexpr uint16_t member_page_limit = 1000;
+
+    /*
+     * guild_get_members only hands back guild_member objects, the raw member
+     * list also carries the user object so one page fills both caches
+     */
+    util::shared_awaiter<member_page> co_get_member_page(dpp::snowflake guild_id, dpp::snowflake after) {
+        auto result = std::make_shared<util::shared_result<member_page>>();
+        auto route = fmt::format("guilds/{}/members", (uint64_t)guild_id);
+
+        bool queued = rest.submit(rp_cache, route, [this, result, guild_id, after](auto done) {
+            backend->guild_members_page(guild_id, after, member_page_limit,
+                [result, guild_id, done](nlohmann::json &j, const dpp::http_request_completion_t &http) {
+                    member_page page;
+                    if (http.status >= 400 || !j.is_array()) {
+                        log("Error fetching members of guild %lu, status %u\n%s\n", (uint64_t)guild_id, http.status, http.body.c_str());
+                        page.error = true;
+                    } else {
+                        page.members.reserve(j.size());
+                        for (auto &m : j) {
+                            if (!m.contains("user")) continue;
+                            dpp::user user;
+                            user.fill_from_json(&m["user"]);
+                            dpp::guild_member member;
+                            member.fill_from_json(&m, guild_id, user.id);
+                            page.members.emplace_back(std::move(user), std::move(member));
+                        }
+                    }
+                    done(dpp::confirmation_callback_t(http));
+                    result->set(std::move(page));
+                });
+        }, [](const dpp::confirmation_callback_t&) { });
+
+        if (!queued)
+            result->set(member_page{ {}, true });
+        return { result };
     }
 
-    void add_channel(const dpp::snowflake channel_id) {
-        util::auto_wait w;
-        bot.channel_get(channel_id, [&,channel_id](dpp::confirmation_callback_t e) {
-            util::hold h(w);
-            if (e.is_error()) { 
-                handle_apierror(e.get_error(), fmt::format("channel: {}", (uint64_t)channel_id));
-                return;
+    dpp::job sync_guild_members(dpp::snowflake guild_id) {
+        auto *guild = co_await co_get_guild(guild_id);
+        if (!guild || guild->members_synced || guild->members_syncing.exchange(true)) co_return;
+
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&start]() {
+            return (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        dpp::snowflake after = 0;
+        size_t pages = 0, count = 0;
+        bool failed = false;
+
+        log("Syncing members of guild [%lu] %s\n", (uint64_t)guild->id, guild->name.c_str());
+
+        while (true) {
+            auto page = co_await co_get_member_page(guild_id, after);
+            if (page.error) {
+                failed = true;
+                break;
             }
 
-            add_channel(channel_id, std::get<dpp::channel>(e.value));
-        });
+            for (auto &[user, member] : page.members) {
+                auto *user_data = find_user(user.id);
+                if (!user_data) {
+                    add_user(user.id, user);
+                    user_data = find_user(user.id);
+                } else {
+                    refresh_user(user);
+                }
+                if (!refresh_guild_user(guild, member))
+                    add_guild_user(guild, user_data, user.id, member);
+                if (user.id > after)
+                    after = user.id;
+            }
+
+            count += page.members.size();
+            pages++;
+
+            log("\tguild [%lu] page %lu, %lu members, %ld ms\n", (uint64_t)guild->id, pages, count, elapsed());
+
+            if (page.members.size() < member_page_limit)
+                break;
+        }
+
+        guild->members_syncing = false;
+        guild->members_synced = !failed;
+        if (!failed)
+            guild->members_fetched_at = util::unix_now();
+
+        log("%s members of guild [%lu] %s, %lu members in %lu pages, %ld ms\n", failed ? "Failed syncing" : "Synced", (uint64_t)guild->id, guild->name.c_str(), count, pages, elapsed());
     }
 
     void message_create(const dpp::message &m) {
         //logs(m.content);
-        bot.message_create(m, confirmation_handler);
+        rest_call(rp_welcome, fmt::format("channels/{}/messages", (uint64_t)m.channel_id), [this, m](auto done) {
+            backend->message_create(m, done);
+        });
     }
 
     int handle_apierror(const dpp::error_info &e, std::string extra = "") {
@@ -818,297 +4912,1002 @@ struct Program : public BotData {
         if (!v) {
             return or_str;
         }
-        return v->cached.get_mention();
+        return v->get_mention();
+    }
+
+    struct command_context {
+        dpp::slashcommand_t &e;
+        GuildData *guild;
+        dpp::message base_message;
+        dpp::embed base_embed;
+
+        dpp::message make_base(std::string_view str) const {
+            return dpp::message(base_message).add_embed(dpp::embed(base_embed).set_description(std::string(str)));
+        }
+    };
+
+    using command_handler = dpp::task<void> (Program::*)(command_context&);
+
+    struct command_option_spec {
+        dpp::command_option_type type;
+        std::string_view name;
+        std::string_view description;
+        std::array<std::string_view, 3> choices {};
+    };
+
+    // An entry with no subcommand and no handler only describes its command
+    struct command_spec {
+        std::string_view command;
+        std::string_view subcommand;
+        std::string_view description;
+        command_handler handler = nullptr;
+        std::array<command_option_spec, 4> options {};
+    };
+
+    // Every slash command, both registration and dispatch are generated from this table
+    static constexpr auto command_table() {
+        using p = Program;
+
+        return std::array<command_spec, 21> {{
+            { "help", "", "Get help", &p::cmd_help },
+
+            { "setup", "", "Admin set up" },
+            { "setup", "visibility", "Set the visibility of my replies", &p::cmd_setup_visibility, {{
+                { dpp::co_boolean, "visibility", "Show my replies to everyone" } }} },
+            { "setup", "welcome_channel", "Set the welcome channel", &p::cmd_setup_welcome_channel, {{
+                { dpp::co_channel, "welcome_channel", "Channel to welcome new members in" } }} },
+            { "setup", "role", "Set bot operator role", &p::cmd_setup_role, {{
+                { dpp::co_role, "role", "Bot operator role" } }} },
+            { "setup", "members", "Reload the member list", &p::cmd_setup_members },
+
+            { "verify", "", "Verification" },
+            { "verify", "all", "Set all members as verified", &p::cmd_verify_all },
+            { "verify", "none", "Clear verification status of all members", &p::cmd_verify_none },
+            { "verify", "user", "User options", &p::cmd_verify_user, {{
+                { dpp::co_user, "user", "Member to change" },
+                { dpp::co_string, "action", "Set or clear verification", { "set", "clear" } } }} },
+            { "verify", "role", "Set verification role", &p::cmd_verify_role, {{
+                { dpp::co_role, "role", "Verification role" } }} },
+
+            { "info", "", "Get info" },
+            { "info", "server", "Get current server config", &p::cmd_info_server },
+            { "info", "bot", "Get bot info", &p::cmd_info_bot },
+            { "info", "stats", "Get handler latencies and cache hit rates", &p::cmd_info_stats },
+            { "info", "memory", "Get cache memory use", &p::cmd_info_memory },
+
+            { "responder", "", "Automatic responses to messages" },
+            { "responder", "reply", "Reply to matching messages", &p::cmd_responder_reply, {{
+                { dpp::co_string, "kind", "How the pattern matches", { "keyword", "prefix", "glob" } },
+                { dpp::co_string, "pattern", "Text to look for, globs use * and ?" },
+                { dpp::co_string, "reply", "Message to post" } }} },
+            { "responder", "role", "Change the author's role on matching messages", &p::cmd_responder_role, {{
+                { dpp::co_string, "kind", "How the pattern matches", { "keyword", "prefix", "glob" } },
+                { dpp::co_string, "pattern", "Text to look for, globs use * and ?" },
+                { dpp::co_role, "role", "Role to change" },
+                { dpp::co_string, "action", "Add or remove the role", { "add", "remove" } } }} },
+            { "responder", "remove", "Remove the responders with a pattern", &p::cmd_responder_remove, {{
+                { dpp::co_string, "pattern", "Pattern to remove" } }} },
+            { "responder", "list", "List the responders", &p::cmd_responder_list },
+        }};
+    }
+
+    static const auto &commands() {
+        static constexpr auto table = command_table();
+        return table;
+    }
+
+    static const command_spec *find_command(std::string_view command, std::string_view subcommand) {
+        static constexpr auto table = command_table();
+        static constexpr auto key = [](const command_spec &c) { return std::pair(c.command, c.subcommand); };
+        static constexpr util::perfect_hash<table.size()> index(table, key);
+
+        return index.find(commands(), key, command, subcommand);
+    }
+
+    static std::vector<dpp::slashcommand> build_commands(dpp::snowflake application_id) {
+        std::vector<dpp::slashcommand> commands;
+
+        for (auto &spec : command_table()) {
+            auto it = std::find_if(commands.begin(), commands.end(), [&](auto &c) { return c.name == spec.command; });
+            if (it == commands.end())
+                it = commands.insert(commands.end(), dpp::slashcommand(std::string(spec.command), "", application_id));
+
+            auto add_options = [&spec](auto &target) {
+                for (auto &o : spec.options) {
+                    if (o.name.empty())
+                        continue;
+                    dpp::command_option option(o.type, std::string(o.name), std::string(o.description), true);
+                    for (auto &choice : o.choices)
+                        if (!choice.empty())
+                            option.add_choice(dpp::command_option_choice(std::string(choice), std::string(choice)));
+                    target.add_option(option);
+                }
+            };
+
+            if (spec.subcommand.empty()) {
+                it->set_description(std::string(spec.description));
+                add_options(*it);
+            } else {
+                dpp::command_option sub(dpp::co_sub_command, std::string(spec.subcommand), std::string(spec.description));
+                add_options(sub);
+                it->add_option(sub);
+            }
+        }
+
+        return commands;
+    }
+
+    // Only the fields we register, so definitions read back from Discord compare equal to ours
+    static nlohmann::json command_json(const dpp::command_option &o) {
+        nlohmann::json j = { { "type", (int)o.type }, { "name", o.name }, { "description", o.description }, { "required", o.required } };
+        for (auto &choice : o.choices)
+            if (auto *value = std::get_if<std::string>(&choice.value))
+                j["choices"].push_back({ choice.name, *value });
+        for (auto &sub : o.options)
+            j["options"].push_back(command_json(sub));
+        return j;
+    }
+
+    static nlohmann::json command_json(const dpp::slashcommand &c) {
+        nlohmann::json j = { { "name", c.name }, { "description", c.description } };
+        for (auto &o : c.options)
+            j["options"].push_back(command_json(o));
+        return j;
+    }
+
+    /*
+     * Registers only the commands that differ from what Discord has. The digest of the
+     * whole set is persisted, so reconnects and restarts with unchanged commands make no calls.
+     */
+    // Every shard's ready lands here, a ready during a sync is skipped since it would do the same work
+    dpp::job sync_commands() {
+        if (commands_syncing.exchange(true)) co_return;
+        co_await co_sync_commands();
+        commands_syncing = false;
+    }
+
+    dpp::task<void> co_sync_commands() {
+        auto commands = build_commands(bot.me.id);
+
+        auto all = nlohmann::json::array();
+        for (auto &c : commands)
+            all.push_back(command_json(c));
+        // Commands belong to the application, a new one with the same commands still needs them registered
+        auto dump = fmt::format("{}:{}", (uint64_t)bot.me.id, all.dump());
+        uint64_t digest = BotSnapshot::checksum(reinterpret_cast<const uint8_t*>(dump.data()), dump.size());
+
+        if (digest == command_digest) {
+            logs("Slash commands unchanged");
+            co_return;
+        }
+
+        auto e = co_await co_rest(rp_cache, "commands", [this](auto done) {
+            backend->global_commands_get(done);
+        });
+        if (e.is_error()) {
+            handle_apierror(e.get_error(), "get commands");
+            co_return;
+        }
+
+        auto registered = std::get<dpp::slashcommand_map>(e.value);
+        std::map<std::string, dpp::slashcommand*, std::less<>> stale;
+        for (auto &[id, c] : registered)
+            stale[c.name] = &c;
+
+        size_t calls = 0;
+        bool failed = false;
+
+        for (auto &c : commands) {
+            auto it = stale.find(c.name);
+            dpp::confirmation_callback_t result;
+
+            if (it == stale.end()) {
+                result = co_await co_rest(rp_cache, "commands", [this, c](auto done) {
+                    backend->global_command_create(c, done);
+                });
+            } else {
+                auto *current = it->second;
+                stale.erase(it);
+                if (command_json(*current) == command_json(c))
+                    continue;
+                c.id = current->id;
+                result = co_await co_rest(rp_cache, "commands", [this, c](auto done) {
+                    backend->global_command_edit(c, done);
+                });
+            }
+
+            calls++;
+            if (result.is_error()) {
+                handle_apierror(result.get_error(), fmt::format("command: {}", c.name));
+                failed = true;
+            }
+        }
+
+        for (auto &[name, c] : stale) {
+            auto result = co_await co_rest(rp_cache, "commands", [this, id = c->id](auto done) {
+                backend->global_command_delete(id, done);
+            });
+            calls++;
+            if (result.is_error()) {
+                handle_apierror(result.get_error(), fmt::format("command: {}", name));
+                failed = true;
+            }
+        }
+
+        log("Synced slash commands, %lu changed\n", calls);
+
+        if (!failed)
+            record_command_digest(digest);
+    }
+
+    dpp::task<void> handle_slashcommand(dpp::slashcommand_t e) {
+        auto &command = e.command;
+        const std::string name = command.get_command_name();
+        auto interaction = command.get_command_interaction();
+        auto &ops = interaction.options;
+
+        auto base_message = dpp::message()
+                                .set_channel_id(command.channel_id);
+
+        auto base_embed = dpp::embed()
+                                .set_color(dpp::colors::sti_blue)
+                                ;//.set_author("Club Robot", bot.me.get_url(), bot.me.get_avatar_url());
+
+        if (!command.is_guild_interaction()) {
+            reply(e, base_message.set_content("I only support commands on servers right now"));
+            co_return;
+        }
+
+        auto *guild = co_await co_get_guild(command.guild_id);
+
+        if (!guild) {
+            reply(e, base_message.set_content("An error occured!"));
+            co_return;
+        }
+
+        if (guild->interact_ephemeral)
+            base_message = base_message.set_flags(dpp::m_ephemeral);
+
+        command_context c { e, guild, base_message, base_embed };
+
+        std::string_view subcommand = !ops.empty() && ops[0].type == dpp::co_sub_command ? std::string_view(ops[0].name) : "";
+        auto *spec = find_command(name, subcommand);
+
+        if (!spec || !spec->handler) {
+            reply(e, c.make_base("More arguments required"));
+            co_return;
+        }
+
+        BotMetrics::timer timer{ command_latency[spec - commands().data()] };
+        co_await (this->*spec->handler)(c);
+    }
+
+    dpp::task<void> cmd_help(command_context &c) {
+        reply(c.e, c.make_base("Verification bot"));
+        co_return;
+    }
+
+    dpp::task<void> cmd_setup_role(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change the operator role"));
+            co_return;
+        }
+        auto crole = std::get<dpp::snowflake>(c.e.get_parameter("role"));
+        auto *role = co_await co_get_guild_role(c.guild, crole);
+        if (!role) {
+            reply(c.e, c.make_base(fmt::format("Failed to set role to {}", crole)));
+            co_return;
+        }
+        c.guild->bot_operator_role = crole;
+        record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Set bot operator role to {}", or_default(role, role->name))));
+    }
+
+    dpp::task<void> cmd_setup_visibility(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change reply visibility"));
+            co_return;
+        }
+        auto cvisi = std::get<bool>(c.e.get_parameter("visibility"));
+        c.guild->interact_ephemeral = !cvisi;
+        record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Set reply visibility to `{}`", cvisi)));
+        co_return;
+    }
+
+    // A full paged sync is thousands of calls on a large server, one at a time and operators only
+    dpp::task<void> cmd_setup_members(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can reload the member list"));
+            co_return;
+        }
+        if (c.guild->members_syncing) {
+            reply(c.e, c.make_base("The member list is already being reloaded"));
+            co_return;
+        }
+        c.guild->members_synced = false;
+        sync_guild_members(c.guild->id);
+        reply(c.e, c.make_base("Reloading the member list"));
+        co_return;
+    }
+
+    dpp::task<void> cmd_setup_welcome_channel(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change the welcome channel"));
+            co_return;
+        }
+        auto cchan = std::get<dpp::snowflake>(c.e.get_parameter("welcome_channel"));
+        auto *chan = co_await co_get_guild_channel(c.guild, cchan);
+        if (!chan) {
+            reply(c.e, c.make_base(fmt::format("Failed to set welcome channel to {}", cchan)));
+            co_return;
+        }
+        c.guild->welcome_channel = cchan;
+        record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Set welcome channel to {}", or_default(chan->channel, chan->name))));
+    }
+
+    dpp::task<void> cmd_info_server(command_context &c) {
+        auto *guild = c.guild;
+        auto *welcome_channel = co_await co_get_guild_channel(guild, guild->welcome_channel);
+        auto *verify_role = co_await co_get_guild_role(guild, guild->verify_role);
+        reply(c.e, c.make_base(
+            fmt::format("\
+Verification role \n\
+{} \n\
+Welcome channel \n\
+{} \n\
+Hide messages \n\
+`{}` \
+", 
+or_default(verify_role),
+welcome_channel ? or_default(welcome_channel->channel) : "`Not set`",
+guild->interact_ephemeral
+            )
+        ));
+    }
+
+    dpp::task<void> cmd_info_bot(command_context &c) {
+        reply(c.e, c.make_base("\
+Verification bot cortesy of VVC Robotics \n\
+https://github.com/VVC-Robotics/Discord-Bot \
+"
+));
+        co_return;
+    }
+
+    /*
+     * Manage Guild (or Administrator) from the permissions Discord resolved for
+     * the interaction, those hold for the owner too. The cached guild can be a
+     * restored one without an owner. Holders of bot_operator_role count as well,
+     * only an operator can set that role.
+     */
+    bool is_operator(const command_context &c) {
+        auto &member = c.e.command.member;
+        if (c.e.command.get_resolved_permission(member.user_id).can(dpp::p_manage_guild))
+            return true;
+        if (!c.guild->bot_operator_role)
+            return false;
+        auto &roles = member.get_roles();
+        return std::find(roles.begin(), roles.end(), (dpp::snowflake)c.guild->bot_operator_role) != roles.end();
+    }
+
+    dpp::task<void> cmd_info_stats(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can see stats"));
+            co_return;
+        }
+        reply(c.e, c.make_base(metrics.summary()));
+    }
+
+    dpp::task<void> cmd_info_memory(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can see memory use"));
+            co_return;
+        }
+        auto m = c.guild->memory_usage();
+        auto &pool = util::string_pool::get();
+        reply(c.e, c.make_base(fmt::format("```\n\
+This server\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+All servers\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+{:<16} {:>8} {:>12} bytes\n\
+```",
+"members", m.members, m.member_bytes,
+"roles", m.roles, m.role_bytes,
+"channels", m.channels, m.channel_bytes,
+"other", "", m.other_bytes,
+"guilds", guilds.size(), guild_bytes(),
+"users", users.size(), user_bytes(),
+"channels", channels.size(), channel_bytes(),
+"interned strings", pool.count.load(), pool.bytes.load()
+        )));
+    }
+
+    dpp::task<void> cmd_responder_reply(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change responders"));
+            co_return;
+        }
+        AutoResponderData rule;
+        rule.kind = std::get<std::string>(c.e.get_parameter("kind"));
+        rule.pattern = std::get<std::string>(c.e.get_parameter("pattern"));
+        rule.reply = std::get<std::string>(c.e.get_parameter("reply"));
+        add_responder(c, std::move(rule));
     }
 
-    void handle_slashcommand(const dpp::slashcommand_t &e) {
-        auto &command = e.command;
-        const std::string name = command.get_command_name();
-        auto interaction = command.get_command_interaction();
-        auto &ops = interaction.options;
-        auto &channel = command.channel;
-        auto &channel_id = command.channel_id;
-        auto argc = ops.size();
+    dpp::task<void> cmd_responder_role(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change responders"));
+            co_return;
+        }
+        AutoResponderData rule;
+        rule.kind = std::get<std::string>(c.e.get_parameter("kind"));
+        rule.pattern = std::get<std::string>(c.e.get_parameter("pattern"));
+        rule.role = std::get<dpp::snowflake>(c.e.get_parameter("role"));
+        rule.action = std::get<std::string>(c.e.get_parameter("action"));
+        auto *role = co_await co_get_guild_role(c.guild, rule.role);
+        if (!role) {
+            reply(c.e, c.make_base(fmt::format("Failed to find role {}", (uint64_t)rule.role)));
+            co_return;
+        }
+        add_responder(c, std::move(rule));
+    }
 
-        auto base_message = dpp::message()
-                                .set_channel_id(channel_id);
+    void add_responder(command_context &c, AutoResponderData rule) {
+        if (rule.pattern.empty() || rule.pattern.size() > AutoResponder::max_pattern) {
+            reply(c.e, c.make_base(fmt::format("Patterns are 1 to {} characters", AutoResponder::max_pattern)));
+            return;
+        }
 
-        auto base_embed = dpp::embed()
-                                .set_color(dpp::colors::sti_blue)
-                                ;//.set_author("Club Robot", bot.me.get_url(), bot.me.get_avatar_url());
+        size_t count = 0;
+        bool added = c.guild->responders.update([&](auto &rules) {
+            if (rules.size() >= AutoResponder::max_rules)
+                return false;
+            rules.push_back(rule);
+            count = rules.size();
+            return true;
+        });
 
-        auto base_moreargs = dpp::message(base_message).add_embed(dpp::embed(base_embed).set_description("More arguments required"));
+        if (!added) {
+            reply(c.e, c.make_base(fmt::format("A server can have at most {} responders", AutoResponder::max_rules)));
+            return;
+        }
 
-        auto make_base = [&base_message, &base_embed](const std::string_view &str) {
-            return base_message.add_embed(base_embed.set_description(str));
-        };
+        record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Added {} responder `{}`, {} in total", rule.kind, rule.pattern, count)));
+    }
 
-        if (!command.is_guild_interaction()) {
-            e.reply(base_message.set_content("I only support commands on servers right now"));
-            return;
+    dpp::task<void> cmd_responder_remove(command_context &c) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can change responders"));
+            co_return;
         }
+        auto pattern = std::get<std::string>(c.e.get_parameter("pattern"));
+        size_t removed = 0;
+        c.guild->responders.update([&](auto &rules) {
+            removed = std::erase_if(rules, [&](auto &rule) { return rule.pattern == pattern; });
+            return removed > 0;
+        });
+        if (removed)
+            record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Removed {} responders matching `{}`", removed, pattern)));
+    }
 
-        auto *guild = get_guild(command.guild_id);
+    dpp::task<void> cmd_responder_list(command_context &c) {
+        auto rules = c.guild->responders.rules();
+        if (rules.empty()) {
+            reply(c.e, c.make_base("No responders"));
+            co_return;
+        }
 
-        if (!guild) {
-            e.reply(base_message.set_content("An error occured!"));
-            return;
+        // Embed descriptions are capped at 4096 characters
+        std::string text;
+        size_t shown = 0;
+        for (auto &rule : rules) {
+            auto line = rule.role
+                ? fmt::format("{} `{}` {} <@&{}>\n", rule.kind, rule.pattern, rule.action, (uint64_t)rule.role)
+                : fmt::format("{} `{}` replies {}\n", rule.kind, rule.pattern, rule.reply);
+            if (text.size() + line.size() > 3900)
+                break;
+            text += line;
+            shown++;
         }
+        if (shown < rules.size())
+            text += fmt::format("and {} more", rules.size() - shown);
 
-        bool guild_ephemeral = guild->interact_ephemeral;
+        reply(c.e, c.make_base(text));
+    }
 
-        {
-            //util::auto_wait w;
-            //e.thinking(guild_ephemeral, [&w](const auto &d){w.notify();});
+    dpp::task<void> cmd_verify_role(command_context &c) {
+        auto crole = std::get<dpp::snowflake>(c.e.get_parameter("role"));
+        auto *role = co_await co_get_guild_role(c.guild, crole);
+        if (!role) {
+            reply(c.e, c.make_base(fmt::format("Failed to set role to {}", crole)));
+            co_return;
         }
+        c.guild->verify_role = crole;
+        record_guild(c.guild);
+        reply(c.e, c.make_base(fmt::format("Set verification role to {}", or_default(role, role->name))));
+    }
 
-        if (guild_ephemeral)
-            base_message = base_message.set_flags(dpp::m_ephemeral);
+    dpp::task<void> cmd_verify_user(command_context &c) {
+        auto *guild = c.guild;
+        auto *vrole = co_await co_get_guild_role(guild, guild->verify_role);
+        dpp::snowflake vroleid = vrole ? vrole->id : dpp::snowflake(0);
+        auto cuser = std::get<dpp::snowflake>(c.e.get_parameter("user"));
+        auto action = std::get<std::string>(c.e.get_parameter("action"));
+        auto *user = co_await co_get_guild_user(guild, cuser);
+        auto user_pin = pin(user);
+        if (!user) {
+            reply(c.e, c.make_base(fmt::format("Failed to set user's role {}", cuser)));
+            co_return;
+        }
+        if (action == "set") {
+            if (vroleid)
+                add_role(guild->id, cuser, vroleid);
+            else
+                co_await add_or_create_role(guild, cuser, "Verified");
+            reply(c.e, c.make_base(fmt::format("Set {} as verified", or_default(user->user, user->user->username))));
+            co_return;
+        }
+        if (!vroleid) {
+            auto *t = co_await co_find_guild_role(guild, "Verified");
+            if (t) vroleid = t->id;
+        }
+        if (!vroleid) {
+            reply(c.e, c.make_base("No verified role!"));
+            co_return;
+        }
+        remove_role(guild->id, cuser, vroleid);
+        user->remove_role(vroleid);
+        reply(c.e, c.make_base(fmt::format("Cleared verification of {}", or_default(user->user, user->user->username))));
+    }
+
+    dpp::task<void> cmd_verify_all(command_context &c) {
+        start_verify_job(c, "all");
+        co_return;
+    }
+
+    dpp::task<void> cmd_verify_none(command_context &c) {
+        start_verify_job(c, "none");
+        co_return;
+    }
 
-        if (argc < 1) {
-            e.reply(base_moreargs);
+    void start_verify_job(command_context &c, const std::string &mode) {
+        if (!is_operator(c)) {
+            reply(c.e, c.make_base("Only bot operators can verify or unverify all members"));
+            return;
+        }
+        if (c.guild->verify_running || c.guild->get_verify_job().mode.size()) {
+            reply(c.e, c.make_base("A bulk verification is already running"));
             return;
         }
 
-        if (name == "help") {
-            e.reply(base_message
-                    .add_embed(
-                    base_embed
-                    .set_description("Verification bot")
-                    ),
-                confirmation_handler
-            );
+        VerifyJobData job;
+        job.mode = mode;
+        job.started_at = util::unix_now();
+        job.token = c.e.command.token;
+        record_verify_job(c.guild, job);
+
+        reply(c.e, c.make_base(mode == "all" ? "Verifying all members" : "Clearing verification of all members"));
+        verify_members(c.guild->id);
+    }
+
+    static constexpr size_t verify_batch_size = 10;
+    static constexpr size_t verify_retries = 3;
+
+    void edit_verify_reply(const VerifyJobData &job, const std::string &text) {
+        if (job.token.empty() || job.started_at + 15 * 60 < util::unix_now())
             return;
+        edit_reply(job.token, dpp::message().add_embed(dpp::embed().set_color(dpp::colors::sti_blue).set_description(text)));
+    }
+
+    /*
+     * Pages through the member list from the persisted cursor and adds or removes the
+     * verification role, skipping members already in the target state. Role changes go
+     * out verify_batch_size at a time with a pause between batches, the cursor is
+     * journaled after each batch so an interrupted job picks up where it stopped.
+     * Failed role changes are retried after the last page and reported if they keep failing.
+     */
+    dpp::job verify_members(dpp::snowflake guild_id) {
+        auto *guild = co_await co_get_guild(guild_id);
+        if (!guild || guild->verify_running.exchange(true)) co_return;
+
+        auto job = guild->get_verify_job();
+        bool add = job.mode == "all";
+
+        GuildRoleData *role = co_await co_get_guild_role(guild, guild->verify_role);
+        if (!role)
+            role = co_await co_find_guild_role(guild, "Verified");
+        if (!role && add)
+            role = co_await role_create_requests.get({ guild->id, "Verified" }, [this, guild_id](auto done) {
+                create_role(guild_id, "Verified", std::move(done));
+            });
+
+        if (!role) {
+            log("No verification role for bulk job in guild %lu\n", (uint64_t)guild_id);
+            edit_verify_reply(job, add ? "Failed to create the verified role" : "No verified role!");
+            record_verify_job(guild, VerifyJobData());
+            guild->verify_running = false;
+            co_return;
         }
 
-        if (name == "setup") {
-            if (ops[0].name == "role") {
-                auto crole = std::get<dpp::snowflake>(e.get_parameter("role"));
-                auto *role = get_guild_role(guild, crole);
-                if (!role) {
-                    e.reply(make_base(fmt::format("Failed to set role to {}", crole)));
-                    return;
+        dpp::snowflake role_id = role->id;
+
+        log("%s guild %lu from member %lu\n", add ? "Verifying" : "Unverifying", (uint64_t)guild_id, job.cursor);
+
+        std::vector<dpp::snowflake> batch;
+        auto flush = [&]() -> dpp::task<void> {
+            // Bulk changes queue as background work so live verifications go first
+            std::vector<util::shared_awaiter<dpp::confirmation_callback_t>> pending;
+            for (auto user_id : batch)
+                pending.push_back(co_rest(rp_cache, fmt::format("guilds/{}/members/roles", (uint64_t)guild_id), [this, add, guild_id, user_id, role_id](auto done) {
+                    if (add) backend->guild_member_add_role(guild_id, user_id, role_id, done);
+                    else backend->guild_member_delete_role(guild_id, user_id, role_id, done);
+                }));
+
+            for (size_t i = 0; i < pending.size(); i++) {
+                auto e = co_await pending[i];
+                if (e.is_error()) {
+                    handle_apierror(e.get_error(), fmt::format("guild: {} user: {}", (uint64_t)guild_id, (uint64_t)batch[i]));
+                    job.failed.push_back(batch[i]);
+                    continue;
                 }
-                guild->bot_operator_role = crole;
-                e.reply(make_base(fmt::format("Set bot operator role to {}", or_default(role, role->name))));
-                return;
-            }
-            if (ops[0].name == "visibility") {
-                auto cvisi = std::get<bool>(e.get_parameter("visibility"));
-                guild->interact_ephemeral = !cvisi;
-                e.reply(make_base(fmt::format("Set reply visibility to `{}`", cvisi)));
-                return;
-            }
-            if (ops[0].name == "welcome_channel") {
-                auto cchan = std::get<dpp::snowflake>(e.get_parameter("welcome_channel"));
-                auto *chan = get_guild_channel(guild, cchan);
-                if (!chan) {
-                    e.reply(make_base(fmt::format("Failed to set welcome channel to {}", cchan)));
-                    return;
+                job.changed++;
+                if (auto *member = guild->get_user(batch[i])) {
+                    if (add) member->add_role(role_id);
+                    else member->remove_role(role_id);
                 }
-                e.reply(make_base(fmt::format("Set welcome channel to {}", or_default(chan->channel, chan->name))));
-                return;
             }
-            return;
-        }
 
-        if (name == "info") {
-            auto *welcome_channel = get_guild_channel(guild, guild->welcome_channel);
-            if (ops[0].name == "server") {
-                e.reply(base_message.add_embed(base_embed.set_description(
-                    fmt::format("\
-Verification role \n\
-{} \n\
-Welcome channel \n\
-{} \n\
-Hide messages \n\
-`{}` \
-", 
-or_default(get_guild_role(guild, guild->verify_role)),
-welcome_channel ? or_default(welcome_channel->channel) : "`Not set`",
-guild->interact_ephemeral
-                    )
-                )));
-                return;
+            batch.clear();
+            record_verify_job(guild, job);
+            edit_verify_reply(job, fmt::format("{} members, {} already done", job.changed, job.skipped));
+            co_await co_sleep(1);
+        };
+
+        while (true) {
+            auto page = co_await co_get_member_page(guild_id, job.cursor);
+            for (size_t attempt = 1; page.error && attempt <= verify_retries; attempt++) {
+                co_await co_sleep(5 * attempt);
+                page = co_await co_get_member_page(guild_id, job.cursor);
             }
-            if (ops[0].name == "bot") {
-                e.reply(make_base("\
-Verification bot cortesy of VVC Robotics \n\
-https://github.com/VVC-Robotics/Discord-Bot \
-"
-));
-                return;
+            if (page.error) {
+                // Cleared so the command can be run again, members already done are skipped then
+                log("Failed fetching members for bulk job in guild %lu\n", (uint64_t)guild_id);
+                edit_verify_reply(job, fmt::format("Failed to fetch the member list after {} members, run the command again to continue", job.changed));
+                record_verify_job(guild, VerifyJobData());
+                guild->verify_running = false;
+                co_return;
             }
-            e.reply(base_moreargs);
-            return;
-        }
 
-        if (name == "verify") {
-            if (ops[0].name == "role") {
-                auto crole = std::get<dpp::snowflake>(e.get_parameter("role"));
-                auto *role = get_guild_role(guild, crole);
-                if (!role) {
-                    e.reply(make_base(fmt::format("Failed to set role to {}", crole)));
-                    return;
+            for (auto &[user, member] : page.members) {
+                auto &roles = member.get_roles();
+                bool has = std::find(roles.begin(), roles.end(), role_id) != roles.end();
+                job.cursor = user.id;
+
+                if (has == add) {
+                    job.skipped++;
+                    continue;
                 }
-                guild->verify_role = crole;
-                e.reply(make_base(fmt::format("Set bot operator role to {}", or_default(role, role->name))));
-                return;
+
+                batch.push_back(user.id);
+                if (batch.size() == verify_batch_size)
+                    co_await flush();
             }
-            if (ops[0].name == "user") {
-                auto *vrole = get_guild_role(guild, guild->verify_role);
-                dpp::snowflake vroleid = vrole ? vrole->id : dpp::snowflake(0);
-                auto cuser = std::get<dpp::snowflake>(e.get_parameter("set"));
-                auto *user = get_guild_user(guild, cuser);
-                if (!user || !ops[0].options.size()) {
-                    e.reply(make_base(fmt::format("Failed to set user's role {}", cuser)));
-                    return;
-                }
-                if (ops[0].name == "set") {
-                    if (vroleid)
-                        add_role(guild->id, cuser, vroleid);
-                    else
-                        add_or_create_role(guild->id, cuser, "Verified");
-                    e.reply(make_base(fmt::format("Set {} as verified", or_default(user->user, user->user->username))));
-                    return;
-                }
-                if (ops[1].name == "clear") {
-                    if (!vroleid) {
-                        auto *t = guild->get_role("Verified");
-                        if (t) vroleid = t->id;
-                    }
-                    if (!vroleid) {
-                        e.reply(make_base("No verified role!"));
-                        return;
-                    }
-                    user->cached.remove_role(vroleid);
-                    e.reply(make_base(fmt::format("Cleared verification of {}", or_default(user->user, user->user->username))));
-                    return;
-                }
+
+            if (!batch.empty())
+                co_await flush();
+            else
+                record_verify_job(guild, job);
+
+            if (page.members.size() < member_page_limit)
+                break;
+        }
+
+        for (size_t attempt = 0; attempt < verify_retries && !job.failed.empty(); attempt++) {
+            auto retry = std::move(job.failed);
+            job.failed.clear();
+            for (auto user_id : retry) {
+                batch.push_back(user_id);
+                if (batch.size() == verify_batch_size)
+                    co_await flush();
             }
-            return;
+            if (!batch.empty())
+                co_await flush();
         }
 
-        e.reply(base_moreargs);
-        return;
+        log("%s guild %lu done, %lu changed, %lu skipped, %lu failed\n", add ? "Verifying" : "Unverifying", (uint64_t)guild_id, job.changed, job.skipped, job.failed.size());
+
+        std::string failed = job.failed.empty() ? "" : fmt::format(", {} failed", job.failed.size());
+        edit_verify_reply(job, fmt::format("{} {} members, {} already done{}", add ? "Verified" : "Unverified", job.changed, job.skipped, failed));
+        record_verify_job(guild, VerifyJobData());
+        guild->verify_running = false;
     }
 
-    void handle_ready(const dpp::ready_t &r) {
+    dpp::task<void> handle_ready(dpp::ready_t r) {
         logs("Connected");
         bot.set_presence(dpp::presence(dpp::ps_online, dpp::activity(dpp::activity_type::at_custom, ".", "Use /", "")));
 
-        using sc = dpp::slashcommand;
-        using co = dpp::command_option;
-        using coc = dpp::command_option_choice;
-        auto csc = dpp::co_sub_command;
-
-        sc setup("setup", "Admin set up", bot.me.id);
-        sc help("help", "Get help", bot.me.id);
-        sc verify("verify", "Verification", bot.me.id);
-        sc info("info", "Get info", bot.me.id);
-
-        std::vector<co> setup_ops = {
-            co(csc, "visibility", "Set the visibility of my replies"),
-            co(dpp::co_channel, "welcome_channel", "Set the welcome channel"),
-            co(dpp::co_role, "role", "Set bot operator role")
-        };
-
-        std::vector<co> verify_ops = {
-            co(csc, "all", "Set all members as verified"),
-            co(csc, "none", "Clear verification status of all members"),
-            co(dpp::co_user, "user", "User options")
-                .add_choice(coc("set", "Set verification"))
-                .add_choice(coc("clear", "Clear verification")),
-            co(dpp::co_role, "role", "Set verification role")
-        };
-
-        std::vector<co> info_ops = {
-            co(csc, "server", "Get current server config"),
-            co(csc, "bot", "Get bot info")
-        };
-
-        auto add_ops = [](auto &v, auto &ops) {
-            for (auto &c : ops)
-                v.add_option(c);
-        };
-
-        add_ops(setup, setup_ops);
-        add_ops(verify, verify_ops);
-        add_ops(info, info_ops);
+        co_await on_ready();
+    }
 
-        std::vector<sc> commands = { setup, help, verify, info };
+    // Everything after the gateway is up, only goes through the backend so it also runs offline
+    dpp::task<void> on_ready() {
+        // Commands are global, one cluster registers them for all
+        if (cluster_id == 0)
+            sync_commands();
 
-        if (!commands.empty())    
-            bot.global_bulk_command_create(commands, confirmation_handler);
-    
-        {
-        util::auto_wait w;
-        bot.current_user_get_guilds([&](dpp::confirmation_callback_t e) -> dpp::task <void> {
-            util::hold h(w);
-            if (e.is_error()) { handle_apierror(e.get_error()); co_return; }
+        auto e = co_await co_rest(rp_cache, "users/@me/guilds", [this](auto done) {
+            backend->current_user_get_guilds(done);
+        });
 
+        if (e.is_error()) {
+            handle_apierror(e.get_error());
+        } else {
             auto &guildmap = std::get<dpp::guild_map>(e.value);
+
+            // The list has every guild of the bot, other clusters look after the ones not on our shards
+            std::erase_if(guildmap, [this](auto &pair) { return !owns_guild(pair.first); });
             
             log("Handling %lu guilds\n", guildmap.size());
 
-            std::for_each(guildmap.begin(), guildmap.end(), [&](auto &pair){ 
-                //add_guild(pair.first); // dpp::guild_map is returned incomplete, make a full request for guild data
-                auto guild_id = pair.first;
-                GuildData *cached = get_guild(guild_id);
+            // dpp::guild_map is returned incomplete, make a full request for guild data
+            std::vector<dpp::task<GuildData*>> pending;
+
+            for (auto &[guild_id, partial] : guildmap) {
+                GuildData *cached = find_guild(guild_id);
 
                 if (!cached || !cached->id) {
-                    add_guild(pair.first);
-                    return;
+                    pending.push_back(co_get_guild(guild_id));
+                    continue;
                 }
                 
                 log("Found guild    [%lu] %s\n", cached->id, cached->name.c_str());
+            }
+
+            for (auto &t : pending)
+                co_await std::move(t);
+
+            for (auto &[guild_id, partial] : guildmap) {
+                sync_guild_members(guild_id);
+
+                auto *guild = find_guild(guild_id);
+                // A role table restored past cache_ttl is refetched now rather than on the first miss
+                if (guild && !guild->roles_synced)
+                    detach(co_sync_guild_roles(guild));
+                if (guild && guild->get_verify_job().mode.size())
+                    verify_members(guild_id);
+            }
+
+            if (dpp::run_once<struct revalidate_caches_once>())
+                revalidate_caches();
+
+            if (dpp::run_once<struct metrics_timer_once>() && metrics_file.size())
+                write_metrics();
+
+            if (dpp::run_once<struct evict_timer_once>() && (cache_max_entries || cache_max_bytes))
+                sweep_caches();
+        }
+
+        logs("Ready");
+    }
+
+    // Held by a coroutine that keeps a user or member pointer across a co_await, a sweep never frees a pinned entry
+    struct cache_pin {
+        Program *prog;
+        const void *entry;
+
+        cache_pin(Program *prog, const void *entry):prog(prog),entry(entry) {
+            if (!entry) return;
+            std::unique_lock<std::mutex> lock(prog->pin_lock);
+            prog->pins[entry]++;
+        }
+
+        cache_pin(const cache_pin &) = delete;
+        cache_pin &operator=(const cache_pin &) = delete;
+
+        ~cache_pin() {
+            if (!entry) return;
+            std::unique_lock<std::mutex> lock(prog->pin_lock);
+            auto it = prog->pins.find(entry);
+            if (--it->second == 0)
+                prog->pins.erase(it);
+        }
+    };
+
+    std::mutex pin_lock;
+    std::unordered_map<const void*, uint32_t> pins;
+
+    // Take it right after the lookup, the referenced bit the lookup set covers the gap until the next sweep
+    cache_pin pin(const void *entry) {
+        return cache_pin(this, entry);
+    }
+
+    bool is_pinned(const void *entry) {
+        std::unique_lock<std::mutex> lock(pin_lock);
+        return pins.contains(entry);
+    }
+
+    /*
+     * CLOCK eviction of users and members. Every use sets an entry's referenced
+     * bit and each sweep clears it, so an entry found clear went unused for a
+     * whole interval. Handlers that still hold a pointer across a suspension
+     * pin the entry, the final check under the shard lock skips those. Members
+     * point at their user, the walk keeps those users referenced and they become
+     * evictable a sweep after their last member.
+     */
+    size_t evict_caches() {
+        struct candidate {
+            GuildData *guild;
+            dpp::snowflake id;
+        };
+
+        std::vector<candidate> idle_members;
+        std::vector<dpp::snowflake> idle_users;
+        size_t count = 0, bytes = 0;
+
+        guilds.for_each([&](auto &pair) {
+            auto *guild = &pair.second;
+            // A running member sync is adding entries the sweep has not seen yet
+            bool syncing = guild->members_syncing;
+            guild->users.for_each([&](auto &member) {
+                count++;
+                bytes += sizeof(member) + member.second.heap_bytes();
+                if (member.second.user)
+                    member.second.user->touch();
+                if (!member.second.referenced.exchange(false, std::memory_order_relaxed) && !syncing)
+                    idle_members.push_back({ guild, member.first });
             });
+        });
 
-            co_return;
+        users.for_each([&](auto &pair) {
+            count++;
+            bytes += sizeof(pair) + pair.second.heap_bytes();
+            if (!pair.second.referenced.exchange(false, std::memory_order_relaxed))
+                idle_users.push_back(pair.first);
         });
+
+        size_t target = count;
+        if (cache_max_entries)
+            target = std::min<size_t>(target, cache_max_entries);
+        if (cache_max_bytes && bytes > cache_max_bytes)
+            target = std::min<size_t>(target, count * ((double)cache_max_bytes / bytes));
+        if (count <= target) return 0;
+
+        size_t need = count - target, members = 0, evicted_users = 0;
+        auto idle = [this](auto &entry) { return !entry.referenced.load(std::memory_order_relaxed) && !is_pinned(&entry); };
+
+        for (auto &c : idle_members) {
+            if (members >= need) break;
+            members += c.guild->users.erase_if(c.id, idle);
+        }
+        for (auto id : idle_users) {
+            if (members + evicted_users >= need) break;
+            evicted_users += users.erase_if(id, idle);
         }
 
-        bot.start_timer([&](const dpp::timer& h) {
-            save();
-        }, 300);
+        guild_users_cache->evict += members;
+        users_cache->evict += evicted_users;
 
-        logs("Ready");
+        log("Evicted %lu members, %lu users, %lu entries were over the cap\n", members, evicted_users, need);
+        return members + evicted_users;
+    }
+
+    dpp::job sweep_caches() {
+        while (true) {
+            co_await co_sleep(cache_sweep_interval);
+            evict_caches();
+        }
+    }
+
+    dpp::job write_metrics() {
+        while (true) {
+            co_await co_sleep(metrics_interval);
+            metrics.write_file(partition_path(metrics_file));
+        }
     }
 
-    void handle_guild_user_add(const dpp::guild_member_add_t &e) {
+    dpp::task<void> handle_guild_user_add(dpp::guild_member_add_t e) {
+        BotMetrics::timer timer{ guild_user_add_latency };
         auto &guild = e.adding_guild;
-        auto *guild_data = get_guild(guild);
+        auto *guild_data = co_await co_get_guild(guild.id);
 
         if (!guild_data) {
             logs("User added with no guild data associated");
-            return;
+            co_return;
         }
 
         auto &user = e.added;
-        auto *user_data = get_user(user.user_id);
+        auto *user_data = co_await co_get_user(user.user_id);
     
         if (!user_data) {
             logs("User added with no user data associated");
-            return;
+            co_return;
         }
 
-        log("Cached guild user [%lu] %s");
+        log("Cached guild user [%lu] %s\n", user_data->id, user_data->username.c_str());
 
         if (guild_data->welcome_channel) {
-            message_create(create_welcome_message(user.get_mention(), guild_data->welcome_channel));
+            queue_welcome(guild_data, user.get_mention());
         } else {
             logs("No verification channel");
         }
     }
 
     void handle_message(const dpp::message_create_t &e) {
-        logs(e.msg);
+        BotMetrics::timer timer{ message_latency };
+
+        if constexpr (util::ll_debug >= LOG_LEVEL) {
+            uint64_t skipped;
+            if (message_trace.allow(skipped))
+                logs(e.msg);
+            if (skipped)
+                log_with(util::ll_debug, util::log_fields(), "Skipped %lu message traces\n", skipped);
+        }
 
         if (e.msg.content == "devtest")
-            message_create(create_welcome_message(e.msg.author.get_mention(), e.msg.channel_id));
+            message_create(create_welcome_message(e.msg.guild_id, e.msg.channel_id, e.msg.author.get_mention()));
+
+        if (e.msg.guild_id && !e.msg.author.is_bot())
+            run_responders(e.msg);
+    }
+
+    // Only guilds already in memory, a message never waits on a fetch
+    void run_responders(const dpp::message &m) {
+        auto *guild = util::get_or_null(guilds, m.guild_id);
+        if (!guild) return;
+
+        auto responder = guild->responders.get();
+        if (!responder) return;
+
+        GuildUserData *member = nullptr;
+
+        for (auto *rule : responder->match(m.content)) {
+            // Replies are set by operators but triggered by anyone, they never ping
+            if (rule->reply.size())
+                message_create(dpp::message(m.channel_id, rule->reply).set_allowed_mentions(false, false, false, false, {}, {}));
+
+            if (!rule->role) continue;
+
+            if (!member) member = guild->get_user(m.author.id);
+            if (!member) member = cache_message_author(guild, m);
+            // Without the member's roles every message would be a role call
+            if (!member) continue;
+
+            bool has = member->has_role(rule->role);
+
+            if (rule->action == "remove" && has) {
+                remove_role(guild->id, m.author.id, rule->role);
+                member->remove_role(rule->role);
+            } else if (rule->action == "add" && !has) {
+                add_role(guild->id, m.author.id, rule->role);
+                member->add_role(rule->role);
+            }
+        }
+    }
+
+    // Guild messages carry the author's member object, enough to cache the member without a fetch
+    GuildUserData *cache_message_author(GuildData *guild, const dpp::message &m) {
+        if (m.member.user_id != m.author.id) return nullptr;
+
+        auto *user = find_user(m.author.id);
+        if (!user) {
+            add_user(m.author.id, m.author);
+            user = find_user(m.author.id);
+        }
+        add_guild_user(guild, user, m.author.id, m.member);
+        return guild->get_user(m.author.id);
     }
 
-    void handle_button_click(const dpp::button_click_t &e) {
+    dpp::task<void> handle_button_click(dpp::button_click_t e) {
         auto &id = e.custom_id;
         auto &command = e.command;
 
@@ -1116,11 +5915,46 @@ https://github.com/VVC-Robotics/Discord-Bot \
 
         const auto &issuer = e.command.get_issuing_user();
 
-        auto *user = get_user(issuer);
+        auto *user = co_await co_get_user(issuer.id);
 
         log("Button clicked \"%s\" by %s\n", id.c_str(), user ? user->username.c_str() : "undefined");
 
-        if (id == "verify_button") on_user_verify(e);
+        if (id == "verify_button") co_await on_user_verify(e);
+    }
+
+    void handle_role_create(const dpp::guild_role_create_t &e) {
+        auto &role = e.created;
+        auto *guild = find_guild(role.guild_id);
+        if (!guild) return;
+
+        add_guild_role(guild, role.id, role);
+    }
+
+    void handle_role_update(const dpp::guild_role_update_t &e) {
+        auto &role = e.updated;
+        auto *guild = find_guild(role.guild_id);
+        if (!guild) return;
+
+        auto *data = guild->get_role(role.id);
+        if (!data) {
+            add_guild_role(guild, role.id, role);
+            return;
+        }
+
+        guild->unindex_role(data);
+        data->assign(role);
+        data->fetched_at = util::unix_now();
+        guild->index_role(data);
+
+        log("Updated grole %p %lu\n", guild, data->id);
+    }
+
+    void handle_role_delete(const dpp::guild_role_delete_t &e) {
+        auto *guild = find_guild(e.deleting_guild.id);
+        if (!guild) return;
+
+        if (guild->erase_role(e.role_id))
+            log("Removed grole %p %lu\n", guild, (uint64_t)e.role_id);
     }
 
     virtual void handle_signal(int sig) {
@@ -1128,67 +5962,110 @@ https://github.com/VVC-Robotics/Discord-Bot \
         this->hint_exit();
     }
 
-    virtual void on_user_verify(const dpp::button_click_t &e) {
+    virtual dpp::task<void> on_user_verify(dpp::button_click_t e) {
+        BotMetrics::timer timer{ verify_latency };
         auto &command = e.command;
         if (!command.is_guild_interaction()) {
             logs("User verification in guilds only");
-            return;
+            co_return;
         }
 
         auto &user = command.member;
-        auto *guild_user = get_guild_user(user);
-        
+
+        // Acknowledged before any fetch so a slow member or role lookup can't miss the 3 second deadline.
+        // A post shared by a burst of joins keeps its button for the others, the answer is a private message then
+        bool shared = command.msg.mentions.size() > 1;
+        auto deferred = co_rest(rp_interaction, "interactions", [this, e, shared](auto done) {
+            if (shared)
+                backend->interaction_response(e, dpp::ir_deferred_channel_message_with_source, dpp::message().set_flags(dpp::m_ephemeral), done);
+            else
+                backend->interaction_response(e, dpp::ir_deferred_update_message, dpp::message(), done);
+        });
+
+        auto *guild_user = co_await co_get_guild_user(user);
+        auto guild_user_pin = pin(guild_user);
+        if (guild_user)
+            co_await add_or_create_role(guild_user, "Verified");
+
+        if ((co_await deferred).is_error()) co_return;
+
         if (!guild_user) {
             logs("No guild user associated with interaction");
-            return;
+            if (shared)
+                edit_reply(command.token, dpp::message("Could not verify you, try again later"));
+            co_return;
         }
 
-        add_or_create_role(guild_user, "Verified");
-        e.reply(dpp::ir_update_message, fmt::format("You are now verified {}!", user.get_mention()));
+        edit_reply(command.token, dpp::message(fmt::format("You are now verified {}!", user.get_mention())));
+    }
+
+    void edit_reply(const std::string &token, const dpp::message &m) {
+        rest_call(rp_interaction, "interactions", [this, token, m](auto done) {
+            backend->interaction_response_edit(token, m, done);
+        });
     }
 
     void add_role(dpp::snowflake guild, dpp::snowflake user, dpp::snowflake role) {
-        log("Adding role %lu to user %lu in guild %lu\n", role, user, guild);
+        log_with(util::ll_info, (util::log_fields{ guild, user, "add_role" }), "Adding role %lu\n", (uint64_t)role);
 
-        bot.guild_member_add_role(guild, user, role, confirmation_handler);
+        rest_call(rp_verify, fmt::format("guilds/{}/members/roles", (uint64_t)guild), [this, guild, user, role](auto done) {
+            backend->guild_member_add_role(guild, user, role, done);
+        });
     }
 
-    void create_role(dpp::snowflake guild, dpp::snowflake user, std::string role_name) {
-        log("Creating role \"%s\" for user %lu in guild %lu\n", role_name.c_str(), user, guild);
+    void remove_role(dpp::snowflake guild, dpp::snowflake user, dpp::snowflake role) {
+        log_with(util::ll_info, (util::log_fields{ guild, user, "remove_role" }), "Removing role %lu\n", (uint64_t)role);
 
-        bot.role_create(dpp::role().set_name(role_name).set_guild_id(guild), [&,guild,user,role_name](dpp::confirmation_callback_t e) {
-            if (e.is_error()) { handle_apierror(e.get_error()); return; }
+        rest_call(rp_verify, fmt::format("guilds/{}/members/roles", (uint64_t)guild), [this, guild, user, role](auto done) {
+            backend->guild_member_delete_role(guild, user, role, done);
+        });
+    }
 
-            auto role = std::get<dpp::role>(e.value);
+    dpp::job create_role(dpp::snowflake guild_id, std::string role_name, std::function<void(GuildRoleData*)> done) {
+        log("Creating role \"%s\" in guild %lu\n", role_name.c_str(), guild_id);
 
-            add_role(guild, user, role.id);
+        auto e = co_await co_rest(rp_verify, fmt::format("guilds/{}/roles", (uint64_t)guild_id), [this, guild_id, role_name](auto done) {
+            backend->role_create(dpp::role().set_name(role_name).set_guild_id(guild_id), done);
         });
+        if (e.is_error()) {
+            handle_apierror(e.get_error(), fmt::format("guild: {} role: {}", (uint64_t)guild_id, role_name));
+            done(nullptr);
+            co_return;
+        }
+
+        auto *guild = co_await co_get_guild(guild_id);
+        if (!guild) {
+            done(nullptr);
+            co_return;
+        }
+
+        auto role = std::get<dpp::role>(e.value);
+
+        add_guild_role(guild, role.id, role);
+        done(util::get_or_null(guild->roles, role.id));
     }
 
-    void add_or_create_role(dpp::snowflake guild, dpp::snowflake user, std::string role_name) {
-        bot.roles_get(guild, [&,guild,user,role_name](dpp::confirmation_callback_t e) {
-            if (e.is_error()) { handle_apierror(e.get_error()); return; }
+    dpp::task<void> add_or_create_role(GuildData *guild, dpp::snowflake user, std::string role_name) {
+        auto *role = co_await co_find_guild_role(guild, role_name);
 
-            auto &roles = std::get<dpp::role_map>(e.value);
-            auto iter = std::find_if(roles.begin(), roles.end(), [role_name](const auto &p) { return p.second.name == role_name; });
+        if (!role)
+            role = co_await role_create_requests.get({ guild->id, role_name }, [this, guild_id = guild->id, role_name](auto done) {
+                create_role(guild_id, role_name, std::move(done));
+            });
 
-            if (iter != roles.end())
-                add_role(guild, user, (*iter).second.id);
-            else
-                create_role(guild, user, role_name);
-        });
+        if (role)
+            add_role(guild->id, user, role->id);
     }
 
-    void add_or_create_role(GuildUserData *user, std::string role_name) {
-        add_or_create_role(user->guild->id, user->user->id, role_name);
+    dpp::task<void> add_or_create_role(GuildUserData *user, std::string role_name) {
+        co_await add_or_create_role(user->guild, user->user->id, role_name);
     }
 
-    dpp::message create_welcome_message(std::string user_mention, dpp::snowflake channel_id) {
+    dpp::message create_welcome_skeleton(dpp::snowflake channel_id) {
         auto m = dpp::message();
 
         m.set_channel_id(channel_id);
-        m.set_content("Welcome " + user_mention + "!\n\nClick the button to become verified!");
-        
+
         // Set later
         //m.set_flags(dpp::m_ephemeral);
 
@@ -1202,13 +6079,78 @@ https://github.com/VVC-Robotics/Discord-Bot \
 
         return m;
     }
+
+    dpp::message create_welcome_message(dpp::snowflake guild_id, dpp::snowflake channel_id, const std::string &mentions) {
+        dpp::message m;
+        {
+            std::unique_lock<std::mutex> lock(welcome_lock);
+            auto &skeleton = welcome_skeletons[guild_id];
+            if (skeleton.channel_id != channel_id)
+                skeleton = create_welcome_skeleton(channel_id);
+            m = skeleton;
+        }
+        m.set_content("Welcome " + mentions + "!\n\nClick the button to become verified!");
+        return m;
+    }
+
+    // The first join in a quiet guild opens a window, everyone joining within it shares one post
+    void queue_welcome(GuildData *guild, std::string mention) {
+        bool schedule = false;
+        {
+            std::unique_lock<std::mutex> lock(welcome_lock);
+            auto &batch = welcomes[guild->id];
+            batch.channel_id = guild->welcome_channel;
+            batch.mentions.push_back(std::move(mention));
+
+            schedule = !batch.scheduled;
+            batch.scheduled = true;
+        }
+
+        if (schedule)
+            flush_welcomes(guild->id);
+    }
+
+    // Mentions per post, keeps the content well under Discord's 2000 characters
+    static constexpr size_t welcome_mentions_per_post = 50;
+
+    dpp::job flush_welcomes(dpp::snowflake guild_id) {
+        co_await co_sleep(welcome_window);
+
+        dpp::snowflake channel_id;
+        std::vector<std::string> mentions;
+        {
+            // The next join in this guild starts a new batch
+            std::unique_lock<std::mutex> lock(welcome_lock);
+            auto node = welcomes.extract(guild_id);
+            if (node.empty()) co_return;
+            channel_id = node.mapped().channel_id;
+            mentions = std::move(node.mapped().mentions);
+        }
+
+        if (mentions.size() > 1)
+            log("Welcoming %lu members in guild %lu\n", mentions.size(), (uint64_t)guild_id);
+
+        for (size_t i = 0; i < mentions.size(); i += welcome_mentions_per_post) {
+            std::string text;
+            for (size_t j = i; j < std::min(mentions.size(), i + welcome_mentions_per_post); j++) {
+                if (j > i) text += ", ";
+                text += mentions[j];
+            }
+            message_create(create_welcome_message(guild_id, channel_id, text));
+        }
+    }
 };
 
-int main() {
+#ifndef DISCORD_BOT_BENCHMARK
+int main(int argc, char **argv) {
     static Program prog;
 
+    if (argc > 1)
+        return prog.command(argc - 1, argv + 1);
+
     prog.load();    
     signal(SIGINT, [](int i){ prog.signal_handler(i); });
 
     return prog.run();
-}
\ No newline at end of file
+}
+#endif